@@ -9,6 +9,16 @@ namespace guiding {
     using VectorXf = typename MitsubaVector<D>::Type;
 }
 
+#include <guiding/guiding.h>
+
+namespace guiding {
+    // allows accumulating spectra without locking
+    template<>
+    struct float_components<Spectrum> {
+        static constexpr int value = SPECTRUM_SAMPLES;
+    };
+}
+
 #include <guiding/structures/btree.h>
 #include <guiding/structures/kdtree.h>
 
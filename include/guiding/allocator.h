@@ -0,0 +1,51 @@
+#ifndef LIBGUIDING_ALLOCATOR_H
+#define LIBGUIDING_ALLOCATOR_H
+
+#include <memory_resource>
+
+namespace guiding {
+
+/**
+ * The memory resource shared by all PoolAllocators.
+ * It is intentionally never destroyed, so that trees with static storage duration can
+ * still release their memory during program termination.
+ */
+inline std::pmr::memory_resource *poolResource() {
+    static auto *resource = new std::pmr::synchronized_pool_resource();
+    return resource;
+}
+
+/**
+ * A stateless allocator that serves allocations from a process-wide, thread-safe pool.
+ * Memory released by one rebuild is recycled by the next one, which avoids going to the
+ * system allocator for each of the many small node vectors of nested trees, e.g.:
+ * KDTree<3, BTree<2, Leaf<Empty>, Empty, PoolAllocator>, Empty, PoolAllocator>
+ */
+template<typename T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    PoolAllocator() noexcept = default;
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        return static_cast<T *>(poolResource()->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept {
+        poolResource()->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U> &) const noexcept { return true; }
+
+    template<typename U>
+    bool operator!=(const PoolAllocator<U> &) const noexcept { return false; }
+};
+
+}
+
+#endif
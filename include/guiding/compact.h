@@ -0,0 +1,240 @@
+#ifndef LIBGUIDING_COMPACT_H
+#define LIBGUIDING_COMPACT_H
+
+#include "internal/tree.h"
+
+#include <cstdint>
+
+namespace guiding {
+
+/**
+ * A read-only copy of a distribution that only contains what is needed for sampling and pdf evaluation.
+ * Neither statistics nor densities are stored: the innermost trees store the conditional probabilities of
+ * their splits (see Base::computeSplits) quantized to 8 bits, and the pdf of a point is the product of the
+ * probabilities along the path to its leaf. The outer trees only store their topology, which is needed for lookups.
+ * Sampling and pdf evaluation are consistent with each other, but can deviate slightly from the original distribution.
+ * As in Flat, all nodes of the same nesting level are stored in one contiguous array.
+ */
+template<typename D, template<typename> class Allocator = std::allocator>
+class Compact;
+
+template<typename T, template<typename> class Allocator>
+class Compact<Leaf<T>, Allocator> {
+public:
+    // leaves do not need to be stored, their density follows from the path that leads to them
+    struct View {};
+
+    View view() const { return {}; }
+    size_t byteSize() const { return 0; }
+};
+
+template<
+    typename Base, typename C, typename A,
+    template <typename> class TreeAllocator, typename Traits,
+    template <typename> class Allocator
+>
+class Compact<Tree<Base, C, A, TreeAllocator, Traits>, Allocator> {
+public:
+    typedef Tree<Base, C, A, TreeAllocator, Traits> Distribution;
+    typedef Compact<C, Allocator> ChildCompact;
+
+    typedef typename Distribution::Settings Settings;
+    typedef typename Distribution::Vector Vector;
+    typedef typename Base::ChildData ChildData;
+
+    static constexpr int Dimension = Base::Dimension;
+    static constexpr int Arity = Base::Arity;
+
+    /**
+     * Only the innermost trees are sampled, the others are only used for lookups.
+     */
+    static constexpr bool IsInnermost = C::IsLeaf;
+
+    static constexpr uint32_t LeafFlag = 1u << 31;
+
+    static constexpr int SplitCount = IsInnermost ? Arity - 1 : 0;
+
+    /**
+     * Eight bytes for BTree, KDTree and most other bases.
+     */
+    struct Node {
+        uint32_t child; // for inner nodes the index of the first child, for leaves the root of their child distribution (or'ed with LeafFlag)
+        std::array<uint8_t, SplitCount> quantizedSplits; // see Base::computeSplits
+        ChildData data;
+
+        GUIDING_CPU_GPU bool isLeaf() const { return child & LeafFlag; }
+        GUIDING_CPU_GPU uint32_t childRoot() const { return child & ~LeafFlag; }
+
+        GUIDING_CPU_GPU std::array<Float, Arity - 1> splits() const {
+            std::array<Float, Arity - 1> result;
+            for (int i = 0; i < Arity - 1; ++i)
+                result[i] = quantizedSplits[i] * Float(1.f / 255);
+            return result;
+        }
+
+        void quantize(const std::array<Float, Arity - 1> &splits) {
+            for (int i = 0; i < Arity - 1; ++i) {
+                // probabilities that are not zero (or one) must remain so, otherwise regions could become unreachable
+                int q = int(std::round(splits[i] * 255));
+                q = std::max(q, splits[i] > 0 ? 1 : 0);
+                q = std::min(q, splits[i] < 1 ? 254 : 255);
+                quantizedSplits[i] = uint8_t(q);
+            }
+        }
+    };
+
+    class View : public Base {
+    public:
+        const Node *nodes;
+        typename ChildCompact::View child;
+
+        /**
+         * Evaluates the pdf of the tree whose root is stored at the given index, see Tree::pdf.
+         */
+        template<typename ...Args>
+        GUIDING_CPU_GPU Float pdf(const Settings &settings, uint32_t root, const Vector &x, Args&&... params) const {
+            if constexpr (!is_empty<Args...>::value) {
+                return child.pdf(
+                    settings.child,
+                    childAt(root, x),
+                    std::forward<Args>(params)...
+                );
+            } else {
+                Vector y = x;
+                Float pdf = 1;
+
+                uint32_t index = root;
+                while (!nodes[index].isLeaf()) {
+                    auto &node = nodes[index];
+                    int childIndex = this->childIndex(y, node.data);
+                    pdf *= Arity * this->childProbabilityWithSplits(childIndex, node.splits(), node.data);
+                    index = node.child + childIndex;
+                }
+
+                return pdf;
+            }
+        }
+
+        /**
+         * Samples the tree whose root is stored at the given index, see Tree::sample.
+         */
+        template<typename ...Args>
+        GUIDING_CPU_GPU void sample(const Settings &settings, uint32_t root, Float &pdf, Vector &x, Args&&... params) const {
+            if constexpr (!is_empty<Args...>::value) {
+                child.sample(
+                    settings.child,
+                    childAt(root, x),
+                    pdf,
+                    std::forward<Args>(params)...
+                );
+            } else {
+                pdf = 1;
+
+                Vector base, scale;
+                for (int dim = 0; dim < Dimension; ++dim) {
+                    base[dim] = 0;
+                    scale[dim] = 1;
+                }
+
+                uint32_t index = root;
+                while (!nodes[index].isLeaf()) {
+                    auto &node = nodes[index];
+                    auto splits = node.splits();
+                    int childIndex = this->sampleChildWithSplits(x, base, scale, splits, node.data);
+                    pdf *= Arity * this->childProbabilityWithSplits(childIndex, splits, node.data);
+                    index = node.child + childIndex;
+                }
+
+                for (int dim = 0; dim < Dimension; ++dim) {
+                    x[dim] *= scale[dim];
+                    x[dim] += base[dim];
+                }
+            }
+        }
+
+        /**
+         * The root of the child distribution at the given point, for use with child.
+         */
+        GUIDING_CPU_GPU uint32_t childAt(uint32_t root, const Vector &x) const {
+            return nodes[indexAt(root, x)].childRoot();
+        }
+
+        GUIDING_CPU_GPU uint32_t indexAt(uint32_t root, const Vector &y) const {
+            Vector x = y;
+            uint32_t index = root;
+            while (!nodes[index].isLeaf())
+                index = nodes[index].child + this->childIndex(x, nodes[index].data);
+            return index;
+        }
+    };
+
+    Compact() {}
+
+    /**
+     * Creates a compact copy of the given tree, whose root will be stored at index 0.
+     */
+    explicit Compact(const Distribution &tree) {
+        append(tree);
+    }
+
+    /**
+     * Appends a compact copy of the given tree and returns the index of its root.
+     */
+    uint32_t append(const Distribution &tree) {
+        auto &source = tree.m_nodes;
+        uint32_t base = uint32_t(m_nodes.size());
+        assert(base + source.size() < LeafFlag);
+
+        m_nodes.resize(base + source.size());
+        for (size_t i = 0; i < source.size(); ++i) {
+            auto &from = source[i];
+            auto &to = m_nodes[base + i];
+
+            to.data = from.data;
+
+            if (from.isLeaf()) {
+                uint32_t childRoot = 0;
+                if constexpr (!IsInnermost)
+                    childRoot = m_child.append(from.value);
+                to.child = LeafFlag | childRoot;
+                continue;
+            }
+
+            // children are always stored contiguously
+            for (int child = 1; child < Arity; ++child)
+                assert(from.child(child) == from.child(0) + child);
+
+            to.child = base + uint32_t(from.child(0));
+
+            if constexpr (IsInnermost) {
+                std::array<Float, Arity - 1> splits;
+                tree.computeSplits(from.densities(source.data()), splits, from.data);
+                to.quantize(splits);
+            }
+        }
+
+        return base;
+    }
+
+    /**
+     * The amount of memory occupied by the node arrays of all nesting levels.
+     */
+    size_t byteSize() const {
+        return m_nodes.size() * sizeof(Node) + m_child.byteSize();
+    }
+
+    View view() const {
+        View view;
+        view.nodes = m_nodes.data();
+        view.child = m_child.view();
+        return view;
+    }
+
+private:
+    std::vector<Node, Allocator<Node>> m_nodes;
+    ChildCompact m_child;
+};
+
+}
+
+#endif
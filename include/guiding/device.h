@@ -0,0 +1,159 @@
+#ifndef LIBGUIDING_DEVICE_H
+#define LIBGUIDING_DEVICE_H
+
+#include "wrapper.h"
+#include "flat.h"
+
+namespace guiding {
+
+/**
+ * Mirrors the distributions of a Wrapper in flat buffers (see Flat), so that
+ * sampling and training can happen on the GPU without round-tripping samples to the host.
+ *
+ * Typical usage per rendering pass:
+ * @code
+ * DeviceWrapper<decltype(guiding), CudaManagedAllocator> device(guiding);
+ * launch(device.view());         // calls view.sample/pdf/splat on the device
+ * synchronize();
+ * device.commit(samplesSplatted); // might rebuild the host distribution...
+ * device.update();               // ...which is only uploaded again if it has changed
+ * @endcode
+ */
+template<typename W, template<typename> class Allocator = std::allocator>
+class DeviceWrapper {
+public:
+    typedef typename W::Distribution Distribution;
+    typedef typename W::Vector Vector;
+    typedef typename W::AuxWrapper AuxWrapper;
+    typedef Flat<Distribution, Allocator> FlatDistribution;
+
+    /**
+     * Offers the same operations as Wrapper, with the exception that splat
+     * takes the target value directly (Settings::target is a host function).
+     */
+    struct View {
+        Float uniformProb;
+        typename Distribution::Settings settings;
+
+        typename FlatDistribution::View sampling;
+        typename FlatDistribution::View training;
+
+        template<typename ...Args>
+        GUIDING_CPU_GPU Float sample(Vector &x, Args&&... params) const {
+            if (uniformProb == 1)
+                return 1.f;
+
+            Float pdf = 1 - uniformProb; // guiding probability
+            if (x[0] < uniformProb) {
+                x[0] /= uniformProb;
+                pdf *= sampling.pdf(
+                    settings, 0,
+                    x,
+                    std::forward<Args>(params)...
+                );
+            } else {
+                x[0] -= uniformProb;
+                x[0] /= 1 - uniformProb;
+
+                Float gpdf = 1;
+                sampling.sample(
+                    settings, 0,
+                    gpdf,
+                    x,
+                    std::forward<Args>(params)...
+                );
+                pdf *= gpdf;
+            }
+
+            pdf += uniformProb;
+            return pdf;
+        }
+
+        template<typename ...Args>
+        GUIDING_CPU_GPU Float pdf(Args&&... params) const {
+            if (uniformProb == 1)
+                return 1.f;
+
+            return uniformProb + (1 - uniformProb) * sampling.pdf(
+                settings, 0,
+                std::forward<Args>(params)...
+            );
+        }
+
+        /**
+         * @param random A random number source for stochastic filtering, see Wrapper::splat.
+         */
+        template<typename Random, typename ...Args>
+        GUIDING_CPU_GPU void splat(Random &&random, Float density, const AuxWrapper &aux, Float weight, Args&&... params) const {
+            assert(density >= 0);
+            assert(weight >= 0);
+
+            training.splat(
+                settings, 0, random,
+                density, aux, weight,
+                std::forward<Args>(params)...
+            );
+        }
+    };
+
+    explicit DeviceWrapper(W &wrapper)
+    : m_wrapper(wrapper) {
+        update();
+    }
+
+    /**
+     * Uploads the distributions again if the wrapper has published new ones since the last upload.
+     * @returns Whether views obtained from view() have been invalidated.
+     */
+    bool update() {
+        if (m_uploaded && m_wrapper.generation() == m_generation)
+            return false;
+
+        m_generation = m_wrapper.snapshot([&](const Distribution &sampling, const Distribution &training) {
+            m_sampling = FlatDistribution(sampling);
+            m_training = FlatDistribution(training, true);
+        });
+        m_uploaded = true;
+        return true;
+    }
+
+    /**
+     * Adds the samples that have been splatted through views to the training distribution of the wrapper,
+     * which might trigger a rebuild (call update() afterwards).
+     * Make sure that all device work that splats into the views has finished before calling this.
+     * @param sampleCount The number of samples that have been splatted since the last commit.
+     * @returns Whether the samples have been added, see Wrapper::gatherTraining.
+     */
+    bool commit(size_t sampleCount) {
+        bool added = m_wrapper.gatherTraining(sampleCount, m_generation, [&](Distribution &training) {
+            m_training.gather(training);
+        });
+        m_training.resetStatistics();
+        return added;
+    }
+
+    View view() {
+        View view;
+        view.uniformProb = m_wrapper.settings.uniformProb;
+        view.settings = m_wrapper.settings.child;
+        view.sampling = m_sampling.view();
+        view.training = m_training.view();
+        return view;
+    }
+
+    size_t byteSize() const {
+        return m_sampling.byteSize() + m_training.byteSize();
+    }
+
+private:
+    W &m_wrapper;
+
+    FlatDistribution m_sampling;
+    FlatDistribution m_training;
+    uint64_t m_generation = 0;
+    bool m_uploaded = false;
+};
+
+}
+
+#endif
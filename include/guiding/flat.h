@@ -0,0 +1,553 @@
+#ifndef LIBGUIDING_FLAT_H
+#define LIBGUIDING_FLAT_H
+
+#include "internal/tree.h"
+
+#include <cstdint>
+
+namespace guiding {
+
+/**
+ * A flat copy of a distribution, where the nodes of all nested distributions of the same
+ * nesting level are stored in one contiguous array.
+ * Use an Allocator that returns memory accessible by the GPU (e.g., CUDA managed memory),
+ * and pass the View returned by view() to your kernels, which offers the same
+ * sample/pdf/splat operations as the original distribution.
+ * Samples that have been splatted into a flat copy can be added back to the original
+ * distribution via gather().
+ */
+template<typename D, template<typename> class Allocator = std::allocator>
+class Flat;
+
+/**
+ * Whether atomic<T> stores nothing but the value itself (i.e., no mutex, see float_components),
+ * so that flat distributions accumulating T can be written and mapped as raw bytes (see Snapshot).
+ */
+template<typename T>
+struct is_plain_atomic : std::integral_constant<bool,
+    (float_components<T>::value > 0 || std::is_same<T, Float>::value || std::is_same<T, Empty>::value)
+> {};
+
+template<typename T, template<typename> class Allocator>
+class Flat<Leaf<T>, Allocator> {
+public:
+    typedef Leaf<T> Distribution;
+    typedef typename Distribution::Settings Settings;
+    typedef typename Distribution::AuxWrapper AuxWrapper;
+
+    /**
+     * Whether the arrays of this and all nested levels consist of plain values, see is_plain_atomic.
+     */
+    static constexpr bool IsPlain = is_plain_atomic<T>::value;
+
+    struct View {
+        Distribution *leaves;
+
+        GUIDING_CPU_GPU const Distribution &at(uint32_t index) const {
+            return leaves[index];
+        }
+
+        template<typename Random>
+        GUIDING_CPU_GPU void splat(
+            const Settings &settings, uint32_t index, Random &,
+            Float density, const AuxWrapper &aux, Float weight
+        ) const {
+            leaves[index].splat(settings, density, aux, weight);
+        }
+    };
+
+    /**
+     * Appends a copy of the given leaf and returns its index.
+     * If training is set, the copy does not receive the statistics of the leaf.
+     */
+    uint32_t append(const Distribution &leaf, bool training) {
+        m_leaves.push_back(leaf);
+        if (training)
+            reset(m_leaves.back());
+        return uint32_t(m_leaves.size() - 1);
+    }
+
+    /**
+     * Adds the statistics accumulated in the copy at index to leaf.
+     */
+    void gather(Distribution &leaf, uint32_t index) const {
+        auto &copy = m_leaves[index];
+        leaf.aux     += copy.aux;
+        leaf.weight  += Float(copy.weight);
+        leaf.density += Float(copy.density);
+    }
+
+    void resetStatistics() {
+        for (auto &leaf : m_leaves)
+            reset(leaf);
+    }
+
+    size_t byteSize() const {
+        return m_leaves.size() * sizeof(Distribution);
+    }
+
+    View view() {
+        return { m_leaves.data() };
+    }
+
+    /**
+     * Calls f(data, count, elementSize) for each array of this and all nested levels, outermost first.
+     */
+    template<typename F>
+    void forEachArray(F &&f) const {
+        f((const void *)m_leaves.data(), m_leaves.size(), sizeof(Distribution));
+    }
+
+    /**
+     * Calls f(dimension, arity, auxSize) for this and all nested levels, outermost first
+     * (leaves report zero dimensions).
+     */
+    template<typename F>
+    static void forEachLevel(F &&f) {
+        f(0, 0, sizeof(T));
+    }
+
+    /**
+     * Creates a view of arrays that are stored elsewhere (e.g., in a memory mapped file).
+     * next() is called for each array in the order of forEachArray and returns its address.
+     */
+    template<typename F>
+    static View viewOf(F &&next) {
+        return { (Distribution *)next() };
+    }
+
+    /**
+     * Checks that the arrays returned by next() (an address and element count in the order of forEachArray)
+     * hold at least count distributions and that all indices stored in them are in bounds.
+     * Used to validate data that has not been written by this process (see Snapshot).
+     */
+    template<typename F>
+    static bool validIndices(F &&next, size_t count) {
+        return next().second >= count;
+    }
+
+private:
+    static void reset(Distribution &leaf) {
+        leaf.aux     = T();
+        leaf.weight  = Float(0);
+        leaf.density = Float(0);
+    }
+
+    std::vector<Distribution, Allocator<Distribution>> m_leaves;
+};
+
+template<
+    typename Base, typename C, typename A,
+    template <typename> class TreeAllocator, typename Traits,
+    template <typename> class Allocator
+>
+class Flat<Tree<Base, C, A, TreeAllocator, Traits>, Allocator> {
+public:
+    typedef Tree<Base, C, A, TreeAllocator, Traits> Distribution;
+    typedef Flat<C, Allocator> ChildFlat;
+
+    typedef typename Distribution::Settings Settings;
+    typedef typename Distribution::Vector Vector;
+    typedef typename Distribution::AuxWrapper AuxWrapper;
+    typedef typename Base::ChildData ChildData;
+
+    static constexpr int Dimension = Base::Dimension;
+    static constexpr int Arity = Base::Arity;
+    static constexpr bool IsPlain = is_plain_atomic<A>::value && ChildFlat::IsPlain;
+
+    struct Node {
+        uint32_t firstChild; // zero for leaves, since the root can never be a child
+        uint32_t value; // for leaves, the index of their distribution in the next nesting level
+        Float density;
+        ChildData data;
+
+        GUIDING_CPU_GPU bool isLeaf() const { return firstChild == 0; }
+        GUIDING_CPU_GPU uint32_t child(int index) const { return firstChild + index; }
+    };
+
+    /**
+     * The root of a tree and the statistics that are accumulated for it as a whole.
+     */
+    struct Record {
+        uint32_t root;
+        atomic<A> aux;
+        atomic<Float> weight;
+    };
+
+    class View : public Base {
+    public:
+        Node *nodes;
+        Record *trees;
+        typename ChildFlat::View child;
+
+        template<typename ...Args>
+        GUIDING_CPU_GPU Float pdf(const Settings &settings, uint32_t tree, const Vector &x, Args&&... params) const {
+            auto &node = nodes[indexAt(tree, x)];
+            if constexpr (!is_empty<Args...>::value)
+                return child.pdf(
+                    settings.child,
+                    node.value,
+                    std::forward<Args>(params)...
+                );
+
+            return node.density;
+        }
+
+        /**
+         * Samples the tree with the given index, see Tree::sample.
+         * @returns The index of the leaf that has been sampled in the last nesting level.
+         */
+        template<typename ...Args>
+        GUIDING_CPU_GPU uint32_t sample(const Settings &settings, uint32_t tree, Float &pdf, Vector &x, Args&&... params) const {
+            if constexpr (!is_empty<Args...>::value) {
+                return child.sample(
+                    settings.child,
+                    nodes[indexAt(tree, x)].value,
+                    pdf,
+                    std::forward<Args>(params)...
+                );
+            } else {
+                pdf = 1;
+
+                Vector base, scale;
+                for (int dim = 0; dim < Dimension; ++dim) {
+                    base[dim] = 0;
+                    scale[dim] = 1;
+                }
+
+                uint32_t index = trees[tree].root;
+                while (!nodes[index].isLeaf()) {
+                    auto &node = nodes[index];
+
+                    std::array<Float, Arity> densities;
+                    for (int i = 0; i < Arity; ++i)
+                        densities[i] = nodes[node.child(i)].density;
+
+                    index = node.child(this->sampleChild(x, base, scale, densities, node.data));
+                }
+
+                pdf *= nodes[index].density;
+
+                for (int dim = 0; dim < Dimension; ++dim) {
+                    x[dim] *= scale[dim];
+                    x[dim] += base[dim];
+                }
+
+                return nodes[index].value;
+            }
+        }
+
+        /**
+         * Splats into the tree with the given index, see Tree::splat.
+         */
+        template<typename Random, typename ...Args>
+        GUIDING_CPU_GPU void splat(
+            const Settings &settings, uint32_t tree, Random &random,
+            Float density, const AuxWrapper &aux, Float weight,
+            const Vector &x, Args&&... params
+        ) const {
+            trees[tree].weight += weight;
+            trees[tree].aux    += aux.value;
+
+            const auto filter = Distribution::filtering(settings);
+            if (filter == TreeFilter::ENearest) {
+                child.splat(
+                    settings.child, nodes[indexAt(tree, x)].value, random,
+                    density, aux.child, weight,
+                    std::forward<Args>(params)...
+                );
+                return;
+            }
+
+            Vector cellMin, cellMax;
+            indexAt(tree, x, cellMin, cellMax);
+
+            Float volume = 1;
+            Vector originMin, originMax;
+            for (int dim = 0; dim < Dimension; ++dim) {
+                Float size = cellMax[dim] - cellMin[dim];
+                volume *= size;
+
+                originMin[dim] = x[dim] - size/2;
+                originMax[dim] = x[dim] + size/2;
+            }
+
+            if (filter == TreeFilter::EStochastic) {
+                Vector y;
+                for (int dim = 0; dim < Dimension; ++dim) {
+                    Float alpha = random();
+                    y[dim] = alpha * originMin[dim] + (1-alpha) * originMax[dim];
+                }
+
+                child.splat(
+                    settings.child, nodes[indexAt(tree, y)].value, random,
+                    density, aux.child, weight,
+                    std::forward<Args>(params)...
+                );
+                return;
+            }
+
+            splatFiltered(
+                settings, tree, random,
+                originMin, originMax,
+                density, aux, weight / volume,
+                std::forward<Args>(params)...
+            );
+        }
+
+        GUIDING_CPU_GPU uint32_t indexAt(uint32_t tree, const Vector &x) const {
+            Vector min, max;
+            return indexAt(tree, x, min, max);
+        }
+
+        GUIDING_CPU_GPU uint32_t indexAt(uint32_t tree, const Vector &y, Vector &min, Vector &max) const {
+            Vector x = y;
+            for (int dim = 0; dim < Dimension; ++dim) {
+                min[dim] = 0;
+                max[dim] = 1;
+            }
+
+            uint32_t index = trees[tree].root;
+            while (!nodes[index].isLeaf()) {
+                int childIndex = this->childIndex(x, nodes[index].data);
+                this->boxForChild(childIndex, min, max, nodes[index].data);
+                index = nodes[index].child(childIndex);
+            }
+
+            return index;
+        }
+
+    private:
+        /**
+         * Same traversal as Tree::splatFiltered.
+         */
+        template<typename Random, typename ...Args>
+        GUIDING_CPU_GPU void splatFiltered(
+            const Settings &settings, uint32_t tree, Random &random,
+            const Vector &originMin, const Vector &originMax,
+            Float density, const AuxWrapper &aux, Float weight,
+            Args&&... params
+        ) const {
+            struct Frame {
+                uint32_t node;
+                int nextChild;
+                Vector min, max;
+            };
+
+            Frame stack[Distribution::MaxDepth + 1];
+            int stackSize = 0;
+
+            auto &root = stack[stackSize++];
+            root.node = trees[tree].root;
+            root.nextChild = 0;
+            for (int dim = 0; dim < Dimension; ++dim) {
+                root.min[dim] = 0;
+                root.max[dim] = 1;
+            }
+
+            Float remaining = computeOverlap<Dimension>(originMin, originMax, root.min, root.max);
+            if (!(remaining > 0))
+                return;
+
+            if (nodes[root.node].isLeaf()) {
+                child.splat(
+                    settings.child, nodes[root.node].value, random,
+                    density, aux.child, weight * remaining,
+                    std::forward<Args>(params)...
+                );
+                return;
+            }
+
+            const Float epsilon = remaining * Float(1e-6);
+            while (stackSize > 0) {
+                auto &frame = stack[stackSize - 1];
+                if (frame.nextChild == Arity) {
+                    --stackSize;
+                    continue;
+                }
+
+                auto &node = nodes[frame.node];
+                int childIndex = frame.nextChild++;
+
+                Vector childMin = frame.min;
+                Vector childMax = frame.max;
+                this->boxForChild(childIndex, childMin, childMax, node.data);
+
+                Float overlap = computeOverlap<Dimension>(originMin, originMax, childMin, childMax);
+                if (!(overlap > 0))
+                    continue;
+
+                uint32_t childNode = node.child(childIndex);
+                if (!nodes[childNode].isLeaf()) {
+                    assert(stackSize <= Distribution::MaxDepth);
+                    stack[stackSize++] = { childNode, 0, childMin, childMax };
+                    continue;
+                }
+
+                child.splat(
+                    settings.child, nodes[childNode].value, random,
+                    density, aux.child, weight * overlap,
+                    std::forward<Args>(params)...
+                );
+
+                remaining -= overlap;
+                if (remaining <= epsilon)
+                    return;
+            }
+        }
+    };
+
+    Flat() {}
+
+    /**
+     * Creates a flat copy of the given tree, which will be available as tree index 0.
+     * If training is set, the copy does not receive the statistics of the tree, so
+     * that gather() can later add only the samples that have been splatted into the copy.
+     */
+    explicit Flat(const Distribution &tree, bool training = false) {
+        append(tree, training);
+    }
+
+    /**
+     * Appends a copy of the given tree and returns its index.
+     */
+    uint32_t append(const Distribution &tree, bool training) {
+        auto &source = tree.m_nodes;
+        uint32_t base = uint32_t(m_nodes.size());
+
+        m_nodes.resize(base + source.size());
+        for (size_t i = 0; i < source.size(); ++i) {
+            auto &from = source[i];
+            auto &to = m_nodes[base + i];
+
+            to.density = from.value.density;
+            to.data = from.data;
+
+            if (from.isLeaf()) {
+                to.firstChild = 0;
+                to.value = m_child.append(from.value, training);
+            } else {
+                // children are always stored contiguously
+                for (int child = 1; child < Arity; ++child)
+                    assert(from.child(child) == from.child(0) + child);
+
+                to.firstChild = base + uint32_t(from.child(0));
+                to.value = 0;
+            }
+        }
+
+        Record record;
+        record.root = base;
+        record.aux = training ? A() : tree.aux;
+        record.weight = training ? Float(0) : tree.weight;
+        m_trees.push_back(record);
+
+        return uint32_t(m_trees.size() - 1);
+    }
+
+    /**
+     * Adds the statistics accumulated in the copy with the given index to tree,
+     * which must still have the same structure as when the copy was made.
+     */
+    void gather(Distribution &tree, uint32_t index = 0) const {
+        auto &record = m_trees[index];
+        tree.aux    = tree.aux    + A(record.aux);
+        tree.weight = tree.weight + Float(record.weight);
+
+        for (size_t i = 0; i < tree.m_nodes.size(); ++i) {
+            auto &node = tree.m_nodes[i];
+            auto &copy = m_nodes[record.root + i];
+            assert(node.isLeaf() == copy.isLeaf());
+
+            if (node.isLeaf())
+                m_child.gather(node.value, copy.value);
+        }
+    }
+
+    /**
+     * Discards all statistics that have been accumulated in this copy.
+     */
+    void resetStatistics() {
+        for (auto &record : m_trees) {
+            record.aux = A();
+            record.weight = Float(0);
+        }
+        m_child.resetStatistics();
+    }
+
+    /**
+     * The amount of memory occupied by the node arrays of all nesting levels.
+     */
+    size_t byteSize() const {
+        return m_nodes.size() * sizeof(Node) + m_trees.size() * sizeof(Record) + m_child.byteSize();
+    }
+
+    View view() {
+        View view;
+        view.nodes = m_nodes.data();
+        view.trees = m_trees.data();
+        view.child = m_child.view();
+        return view;
+    }
+
+    /**
+     * See Flat<Leaf<T>>::forEachArray.
+     */
+    template<typename F>
+    void forEachArray(F &&f) const {
+        f((const void *)m_nodes.data(), m_nodes.size(), sizeof(Node));
+        f((const void *)m_trees.data(), m_trees.size(), sizeof(Record));
+        m_child.forEachArray(f);
+    }
+
+    template<typename F>
+    static void forEachLevel(F &&f) {
+        f(Dimension, Arity, sizeof(A));
+        ChildFlat::forEachLevel(f);
+    }
+
+    template<typename F>
+    static View viewOf(F &&next) {
+        View view;
+        view.nodes = (Node *)next();
+        view.trees = (Record *)next();
+        view.child = ChildFlat::viewOf(next);
+        return view;
+    }
+
+    /**
+     * See Flat<Leaf<T>>::validIndices.
+     * Children must be stored after their parents, which rules out cycles.
+     */
+    template<typename F>
+    static bool validIndices(F &&next, size_t count) {
+        auto [nodes, nodeCount] = next();
+        auto [trees, treeCount] = next();
+        if (treeCount < count)
+            return false;
+
+        size_t childCount = 0; // number of distributions the leaves refer to
+        for (size_t i = 0; i < nodeCount; ++i) {
+            auto &node = ((const Node *)nodes)[i];
+            if (node.isLeaf())
+                childCount = std::max(childCount, size_t(node.value) + 1);
+            else if (node.firstChild <= i || size_t(node.firstChild) + Arity > nodeCount)
+                return false;
+        }
+
+        for (size_t i = 0; i < treeCount; ++i)
+            if (((const Record *)trees)[i].root >= nodeCount)
+                return false;
+
+        return ChildFlat::validIndices(next, childCount);
+    }
+
+private:
+    std::vector<Node, Allocator<Node>> m_nodes;
+    std::vector<Record, Allocator<Record>> m_trees;
+    ChildFlat m_child;
+};
+
+}
+
+#endif
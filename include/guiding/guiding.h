@@ -1,13 +1,18 @@
 #ifndef LIBGUIDING_GUIDING_H
 #define LIBGUIDING_GUIDING_H
 
+#include <algorithm>
 #include <atomic>
 #include <fstream>
 #include <iostream>
 #include <array>
 #include <cassert>
+#include <cstring>
 #include <mutex>
 #include <random>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 #ifdef __CUDACC__
 #define GUIDING_CPU_GPU __host__ __device__
@@ -84,7 +89,29 @@ void read(std::istream &is, T &t) {
     }
 }
 
+/**
+ * Describes whether a type is an aggregate of a fixed number of Float components
+ * (e.g., a color or a spectrum).
+ * Specialize this for your own types to allow guiding::atomic to accumulate them
+ * component-wise without a mutex. The type must be trivially copyable
+ * and consist of exactly value many Floats.
+ */
 template<typename V>
+struct float_components {
+    static constexpr int value = 0;
+};
+
+template<size_t N>
+struct float_components<std::array<Float, N>> {
+    static constexpr int value = N;
+};
+
+/**
+ * Allows accumulating values from multiple threads.
+ * This generic implementation guards each value with a mutex, see float_components
+ * for a more efficient alternative.
+ */
+template<typename V, typename = void>
 class atomic {
 public:
     atomic() {}
@@ -140,7 +167,7 @@ public:
         *this = other;
     }
 
-    operator Float() const { return m_value; }
+    GUIDING_CPU_GPU operator Float() const { return m_value; }
 
     GUIDING_CPU_GPU void operator=(const Float &value) {
         m_value = value;
@@ -184,8 +211,9 @@ public:
     }
 
     GUIDING_CPU_GPU void operator+=(const Float &value) {
-        auto current = load();
-        while (!compare_exchange_weak(current, current + value));
+        // accumulation does not need any ordering, results are only read after synchronization
+        auto current = load(std::memory_order_relaxed);
+        while (!compare_exchange_weak(current, current + value, std::memory_order_relaxed));
     }
 
     void write(std::ostream &os) const {
@@ -201,6 +229,79 @@ public:
 };
 #endif
 
+/**
+ * Lock-free accumulation for aggregates of Floats, see float_components.
+ * Each component is a separate atomic, which avoids storing a mutex in every value.
+ */
+template<typename V>
+class atomic<V, typename std::enable_if<(float_components<V>::value > 0)>::type> {
+public:
+    static constexpr int Components = float_components<V>::value;
+
+    static_assert(sizeof(V) == Components * sizeof(Float), "type must consist of exactly the specified number of Floats");
+    static_assert(std::is_trivially_copyable<V>::value, "type must be trivially copyable");
+
+    atomic() {
+        for (auto &component : m_components)
+            component = Float(0);
+    }
+
+    atomic(const V &v) { *this = v; }
+    atomic(const atomic<V> &other) { *this = other; }
+
+    GUIDING_CPU_GPU void operator+=(const V &v) {
+        Float components[Components];
+        memcpy(components, &v, sizeof(V));
+        for (int i = 0; i < Components; ++i)
+            m_components[i] += components[i];
+    }
+
+    GUIDING_CPU_GPU void operator=(const V &v) {
+        Float components[Components];
+        memcpy(components, &v, sizeof(V));
+        for (int i = 0; i < Components; ++i)
+            m_components[i] = components[i];
+    }
+
+    GUIDING_CPU_GPU void operator=(const atomic<V> &other) {
+        for (int i = 0; i < Components; ++i)
+            m_components[i] = other.m_components[i];
+    }
+
+    GUIDING_CPU_GPU void operator+=(const atomic<V> &other) {
+        for (int i = 0; i < Components; ++i)
+            m_components[i] += Float(other.m_components[i]);
+    }
+
+    GUIDING_CPU_GPU operator V() const { return value(); }
+
+    GUIDING_CPU_GPU V operator/(Float other) const { return value() / other; }
+    GUIDING_CPU_GPU V operator*(Float other) const { return value() * other; }
+
+    GUIDING_CPU_GPU V value() const {
+        Float components[Components];
+        for (int i = 0; i < Components; ++i)
+            components[i] = m_components[i];
+        
+        V v;
+        memcpy(&v, components, sizeof(V));
+        return v;
+    }
+
+    void write(std::ostream &os) const {
+        guiding::write(os, value());
+    }
+
+    void read(std::istream &is) {
+        V v;
+        guiding::read(is, v);
+        *this = v;
+    }
+
+private:
+    std::array<atomic<Float>, Components> m_components;
+};
+
 template<int D>
 GUIDING_CPU_GPU Float computeOverlap(const VectorXf<D> &min1, const VectorXf<D> &max1, const VectorXf<D> &min2, const VectorXf<D> &max2) {
     // @todo this ignores the fact that a hypervolume can extend beyond the [0,1) interval
@@ -243,12 +344,103 @@ struct RecurseChild<Child> {
     typedef Child Type;
 };
 
+/**
+ * Calls f(i) for every i in [0, count), distributing indices dynamically over the given number of threads.
+ * The calling thread takes part in the work. A thread count of 0 uses all hardware threads.
+ */
+template<typename F>
+void parallelFor(size_t count, int threads, F &&f) {
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    if (size_t(threads) > count)
+        threads = int(count);
+
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; ++i)
+            f(i);
+        return;
+    }
+
+    std::atomic<size_t> next { 0 };
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;)
+            f(i);
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (int t = 1; t < threads; ++t)
+        pool.emplace_back(worker);
+    worker();
+
+    for (auto &thread : pool)
+        thread.join();
+}
+
+/**
+ * Returns a uniform random number in [0,1) from a generator that is local to the calling thread.
+ * Each thread receives its own seed, so results are not reproducible across runs with multiple threads.
+ * Pass your own generator to splat if you need reproducible results.
+ */
 static inline Float random() {
-    // @todo some people might want to override this!
-    static std::default_random_engine generator;
+    static std::atomic<unsigned> seeds { 0 };
+    thread_local std::default_random_engine generator { seeds.fetch_add(1, std::memory_order_relaxed) + 1 };
     return std::generate_canonical<Float, std::numeric_limits<Float>::digits>(generator);
 }
 
+/**
+ * Detects whether R can be used as a source of uniform random numbers in [0,1),
+ * i.e., whether it can be invoked without arguments and returns a Float.
+ */
+template<typename R>
+struct is_random : std::is_invocable_r<Float, R &> {};
+
+/**
+ * The default random number source for splatting, see random().
+ */
+struct ThreadRandom {
+    Float operator()() const {
+        return random();
+    }
+};
+
+/**
+ * A small generator that derives its random numbers from a seed, which allows
+ * stochastic decisions to be replayed later (e.g., for buffered samples).
+ * Uses the PCG hash from Jarzynski and Olano, "Hash Functions for GPU Rendering".
+ */
+class SeededRandom {
+public:
+    GUIDING_CPU_GPU explicit SeededRandom(uint32_t seed) : m_state(seed) {}
+
+    /**
+     * Derives a seed from a uniform random number in [0,1).
+     */
+    GUIDING_CPU_GPU static uint32_t seed(Float u) {
+        return uint32_t(double(u) * 4294967296.0);
+    }
+
+    GUIDING_CPU_GPU Float operator()() {
+        m_state = m_state * 747796405u + 2891336453u;
+        uint32_t word = ((m_state >> ((m_state >> 28u) + 4u)) ^ m_state) * 277803737u;
+        word = (word >> 22u) ^ word;
+        return Float(word >> 8) * Float(1.f / (1 << 24));
+    }
+
+private:
+    uint32_t m_state;
+};
+
+/**
+ * Summary of the structure of a (nested) distribution, see Tree::collectStatistics.
+ */
+struct TreeStatistics {
+    std::vector<size_t> nodesPerLevel; // node count of all trees at each level of nesting
+    size_t leafCount = 0;
+    size_t emptyLeafCount = 0; // leaves that have not received any samples
+    size_t byteSize = 0;
+};
+
 }
 
 #endif
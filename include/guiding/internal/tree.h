@@ -9,6 +9,8 @@
 #include <cstring>
 #include <cmath>
 #include <cassert>
+#include <functional>
+#include <tuple>
 
 namespace guiding {
 
@@ -25,16 +27,70 @@ class atomic<Empty> {
 public:
     atomic() {}
     atomic(const atomic<Empty> &) {}
-    void operator=(const Empty &) {}
-    void operator=(const atomic<Empty> &) {}
-    void operator+=(const Empty &) {}
-    void operator+=(const atomic<Empty> &) {}
-    Empty operator/(Float) { return {}; }
-    Empty operator*(Float) { return {}; }
+    GUIDING_CPU_GPU void operator=(const Empty &) {}
+    GUIDING_CPU_GPU void operator=(const atomic<Empty> &) {}
+    GUIDING_CPU_GPU void operator+=(const Empty &) {}
+    GUIDING_CPU_GPU void operator+=(const atomic<Empty> &) {}
+    GUIDING_CPU_GPU Empty operator/(Float) { return {}; }
+    GUIDING_CPU_GPU Empty operator*(Float) { return {}; }
+    GUIDING_CPU_GPU operator Empty() const { return {}; }
     void write(std::ostream &) const {}
     void read(std::istream &) {}
 };
 
+/**
+ * Accumulates the weight and aux that a tree receives while splatting, see TreeTraits::AccumulatorStripes.
+ */
+template<typename A, int Stripes>
+class StripedAccumulator {
+public:
+    GUIDING_CPU_GPU void add(Float weight, const A &aux) {
+        auto &stripe = m_stripes[stripeIndex()];
+        stripe.weight += weight;
+        stripe.aux    += aux;
+    }
+
+    Float weight() const {
+        Float sum = 0;
+        for (auto &stripe : m_stripes)
+            sum += Float(stripe.weight);
+        return sum;
+    }
+
+    A aux() const {
+        A sum = A();
+        for (auto &stripe : m_stripes)
+            sum = sum + A(stripe.aux);
+        return sum;
+    }
+
+    void clear() {
+        for (auto &stripe : m_stripes) {
+            stripe.weight = Float(0);
+            stripe.aux    = A();
+        }
+    }
+
+private:
+    // stripes are padded to cache lines so that threads do not share them
+    struct alignas(Stripes > 1 ? 64 : alignof(atomic<Float>)) Stripe {
+        atomic<Float> weight;
+        atomic<A> aux;
+    };
+
+    GUIDING_CPU_GPU static int stripeIndex() {
+        if constexpr (Stripes == 1) {
+            return 0;
+        } else {
+            static std::atomic<int> counter(0);
+            thread_local int index = counter++ % Stripes;
+            return index;
+        }
+    }
+
+    std::array<Stripe, Stripes> m_stripes;
+};
+
 template<typename A, typename C>
 struct WrapAux {
     A value;
@@ -53,11 +109,20 @@ public:
 
     typedef T Aux;
     typedef T AuxWrapper;
+    typedef std::tuple<> Coordinates;
 
     atomic<Aux> aux;
     atomic<Float> weight;
     atomic<Float> density;
 
+    template<typename Random>
+    GUIDING_CPU_GPU std::enable_if_t<is_random<Random>::value> splat(
+        const Settings &settings, Random &&,
+        Float density, const AuxWrapper &aux, Float weight
+    ) {
+        splat(settings, density, aux, weight);
+    }
+
     GUIDING_CPU_GPU void splat(const Settings &settings, Float density, const AuxWrapper &aux, Float weight) {
         if (settings.secondMoment)
             density *= density;
@@ -97,6 +162,39 @@ public:
         density = density * weight;
     }
 
+    /**
+     * Adds the statistics of another leaf, scaled by the given factor.
+     */
+    void merge(const Leaf &other, Float scale = 1) {
+        aux     += T(other.aux) * scale;
+        weight  += Float(other.weight) * scale;
+        density += Float(other.density) * scale;
+    }
+
+    /**
+     * Discards the statistics of this leaf.
+     */
+    void clearStatistics() {
+        aux     = T();
+        weight  = Float(0);
+        density = Float(0);
+    }
+
+    void writeStatistics(std::ostream &os) const {
+        write(os);
+    }
+
+    void readStatistics(std::istream &is) {
+        read(is);
+    }
+
+    /**
+     * Whether this leaf has received samples, see Tree::hasSamples.
+     */
+    bool hasSamples() const {
+        return Float(weight) > 0;
+    }
+
     GUIDING_CPU_GPU Float pdf(const Settings &) const {
         return density;
     }
@@ -113,6 +211,12 @@ public:
         return 1;
     }
 
+    void collectStatistics(TreeStatistics &stats, size_t = 0) const {
+        ++stats.leafCount;
+        if (weight == 0)
+            ++stats.emptyLeafCount;
+    }
+
     void dump(const std::string &prefix) const {
         std::cout << prefix << "Leaf (density=" << density << ", weight=" << weight << ")" << std::endl;
     }
@@ -136,7 +240,9 @@ struct TreeFilter {
         EStochastic = 1,
         EBox        = 2,
 
-        Max         = 3
+        Max         = 3,
+
+        ERuntime    = 0xff // only for TreeTraits::Filtering, uses Settings::filtering
     };
 
     static const char *to_string(TreeFilter::Enum value) {
@@ -154,78 +260,312 @@ struct TreeSplitting {
         EDensity = 0,
         EWeight  = 1,
 
-        Max      = 2
+        Max      = 2,
+
+        ERuntime = 0xff // only for TreeTraits::Splitting, uses Settings::splitting
     };
 };
 
-template<typename Base, typename C, typename A = Empty, template <typename> class Allocator = std::allocator>
+/**
+ * Compile-time options for the memory layout and behavior of a Tree.
+ * Derive from this struct and shadow individual members to customize a tree, e.g.:
+ * struct MyTraits : TreeTraits { static constexpr bool ChildDensities = true; };
+ */
+struct TreeTraits {
+    /**
+     * Stores the densities of the children of each inner node contiguously next to its child
+     * indices, so that sampling does not need to touch the (potentially large) child nodes.
+     * Costs Arity Floats per node.
+     */
+    static constexpr bool ChildDensities = false;
+
+    /**
+     * Type used for node indices, which limits the number of nodes a tree can hold.
+     */
+    typedef uint16_t Index;
+
+    /**
+     * Only stores the index of the first child for each node instead of Arity separate indices.
+     * Children of a node are always allocated contiguously, so the remaining indices are implicit.
+     */
+    static constexpr bool CompactChildren = false;
+
+    /**
+     * Precomputes the conditional probabilities of each split of an inner node when
+     * the tree is built, so that sampling does not need to marginalize child densities.
+     * Costs Arity-1 Floats per node.
+     */
+    static constexpr bool PrecomputedSplits = false;
+
+    /**
+     * Starts lookups (and hence splatting and nested sampling) from a uniform grid with
+     * 2^GridLevels cells per dimension instead of the root, where each cell refers to the deepest node
+     * that contains it. This saves the dependent loads of the upper levels of deep trees.
+     * The grid is updated whenever the topology changes and costs 2^(GridLevels*Dimension) small entries.
+     */
+    static constexpr int GridLevels = 0;
+
+    /**
+     * Stores the densities of the top PyramidLevels levels of innermost trees in a dense, implicitly indexed
+     * pyramid (like a mip-map, where the Arity children of each cell are contiguous), so that sampling descends
+     * through these levels without touching any nodes.
+     * Requires a base that subdivides all dimensions at once (BTree). Combine it with GridLevels of the same
+     * value to also make lookups (and hence splatting and pdf evaluation) through these levels index-free.
+     * The pyramid is updated whenever the topology changes and costs about Arity^PyramidLevels Floats and Indices.
+     * It is only built for trees whose top PyramidLevels levels are fully subdivided (i.e., that have at least
+     * as many nodes as the pyramid has cells), all other trees are sampled by descending through their nodes.
+     */
+    static constexpr int PyramidLevels = 0;
+
+    /**
+     * Builds an alias table over the leaves of innermost trees in build(), so that sampling takes constant
+     * time instead of descending the tree. Leaves are chosen with the same probabilities as by the descent,
+     * but points are mapped into them differently (x[0] selects the leaf, the other dimensions are scaled into it).
+     * Costs one entry per leaf, which holds the leaf box. Has no effect on trees that contain trees.
+     */
+    static constexpr bool AliasTable = false;
+
+    /**
+     * The number of stripes the weight and aux of a tree are accumulated in while splatting, which are
+     * summed up in build(). With more than one stripe, each thread uses its own (cache-line sized) stripe,
+     * so that concurrent splats do not contend for the same cache line. This matters most for trees that
+     * receive many samples from many threads (e.g., the outermost one), and costs 64 bytes per stripe and tree.
+     * Stripes are chosen through a thread-local index, hence this must be 1 for trees that are splatted on the GPU.
+     */
+    static constexpr int AccumulatorStripes = 1;
+
+    /**
+     * Fix the filtering and splitting strategies at compile time, so that the compiler can
+     * remove the branches on Settings::filtering and Settings::splitting from the hot paths.
+     * The corresponding settings are ignored unless these are set to ERuntime.
+     */
+    static constexpr TreeFilter::Enum Filtering = TreeFilter::ERuntime;
+    static constexpr TreeSplitting::Enum Splitting = TreeSplitting::ERuntime;
+};
+
+template<int Arity, bool Enabled>
+struct SplitStorage {
+    /**
+     * Conditional probabilities of choosing the lower half for each split, see Base::computeSplits.
+     */
+    std::array<Float, Arity - 1> splits;
+};
+
+template<int Arity>
+struct SplitStorage<Arity, false> {};
+
+template<typename Index, int Arity, bool Compact>
+struct ChildIndexStorage {
+    /**
+     * Indexed by a bitstring, where each bit describes the slab for one of the
+     * vector dimensions. Bit 0 means lower half [0, 0.5) and bit 1 means upper half
+     * [0.5, 1.0).
+     * The MSB corresponds to the last dimension of the vector.
+     */
+    std::array<Index, Arity> children;
+
+    GUIDING_CPU_GPU Index child(int i) const {
+        return children[i];
+    }
+
+    GUIDING_CPU_GPU void setChildren(Index first) {
+        for (int i = 0; i < Arity; ++i)
+            children[i] = first + i;
+    }
+
+    GUIDING_CPU_GPU bool isLeaf() const {
+        return children[0] == 0;
+    }
+
+    GUIDING_CPU_GPU void markAsLeaf() {
+        children[0] = 0;
+    }
+
+    void write(std::ostream &os) const {
+        guiding::write(os, children);
+    }
+
+    void read(std::istream &is) {
+        guiding::read(is, children);
+    }
+};
+
+template<typename Index, int Arity>
+struct ChildIndexStorage<Index, Arity, true> {
+    /**
+     * The children (indexed like ChildIndexStorage::children) follow this index contiguously.
+     */
+    Index firstChild;
+
+    GUIDING_CPU_GPU Index child(int i) const {
+        return firstChild + i;
+    }
+
+    GUIDING_CPU_GPU void setChildren(Index first) {
+        firstChild = first;
+    }
+
+    GUIDING_CPU_GPU bool isLeaf() const {
+        return firstChild == 0;
+    }
+
+    GUIDING_CPU_GPU void markAsLeaf() {
+        firstChild = 0;
+    }
+
+    void write(std::ostream &os) const {
+        guiding::write(os, firstChild);
+    }
+
+    void read(std::istream &is) {
+        guiding::read(is, firstChild);
+    }
+};
+
+template<typename Node, int Arity, bool Enabled>
+struct ChildDensityStorage {
+    std::array<Float, Arity> childDensities;
+
+    GUIDING_CPU_GPU const std::array<Float, Arity> &densities(const Node *) const {
+        return childDensities;
+    }
+};
+
+template<typename Node, int Arity>
+struct ChildDensityStorage<Node, Arity, false> {
+    // densities are gathered from the child nodes on demand
+
+    GUIDING_CPU_GPU std::array<Float, Arity> densities(const Node *nodes) const {
+        auto &node = static_cast<const Node &>(*this);
+
+        std::array<Float, Arity> result;
+        for (int i = 0; i < Arity; ++i)
+            result[i] = nodes[node.child(i)].value.density;
+        return result;
+    }
+};
+
+/**
+ * Detects whether distributions with settings S accept a node budget (i.e., whether they are trees).
+ */
+template<typename S, typename = void>
+struct has_node_budget : std::false_type {};
+
+template<typename S>
+struct has_node_budget<S, std::void_t<decltype(std::declval<S &>().maxNodes)>> : std::true_type {};
+
+template<typename D, template<typename> class Allocator>
+class Flat;
+
+template<typename D, template<typename> class Allocator>
+class Compact;
+
+template<
+    typename Base, typename C, typename A = Empty,
+    template <typename> class Allocator = std::allocator,
+    typename Traits = TreeTraits
+>
 class Tree : public Base {
+    template<typename D, template<typename> class FlatAllocator>
+    friend class Flat;
+
+    template<typename D, template<typename> class CompactAllocator>
+    friend class Compact;
+
 public:
     static constexpr auto Dimension = Base::Dimension;
     static constexpr auto Arity = Base::Arity;
     static constexpr auto IsLeaf = false;
     static constexpr auto HasAux = !std::is_same<A, Empty>::value;
 
-    typedef uint16_t Index;
+    typedef typename Traits::Index Index;
 
     typedef C Child;
     typedef A Aux;
     typedef typename Base::Vector Vector;
 
+    /**
+     * A batch of vectors in structure-of-arrays layout,
+     * i.e., component dim of the i-th vector is stored at batch[dim][i].
+     */
+    typedef std::array<Float *, Dimension> VectorBatch;
+
+    /**
+     * Number of points whose traversals are interleaved by the batched query methods.
+     */
+    static constexpr int PacketSize = 16;
+
     typedef WrapAux<Aux, typename Child::AuxWrapper> AuxWrapper;
 
+    /**
+     * The coordinates a sample is splatted at, i.e., one vector for this tree
+     * followed by the coordinates of the child distribution.
+     */
+    typedef decltype(std::tuple_cat(
+        std::declval<std::tuple<Vector>>(),
+        std::declval<typename Child::Coordinates>()
+    )) Coordinates;
+
     struct Settings {
         int minDepth = 0;
         int maxDepth = 16;
 
         Float splitThreshold = 0.002f;
+
+        /**
+         * Upper bound for the number of nodes of this tree and all nested trees after refinement (0 means no limit).
+         * If the budget would be exceeded, the split threshold is raised so that only the splits with the
+         * largest criterion are made; levels enforced by minDepth are dropped from the deepest one upwards.
+         * If the children are trees, this tree keeps one node of the budget for each of them, and the remaining
+         * budget is apportioned to the children in proportion to their split criterion (bounded by their own
+         * maxNodes, if set). Every tree retains at least its root.
+         */
+        size_t maxNodes = 0;
+
         bool leafReweighting = true;
         bool mergePartiallyInvalid = false;//Child::IsLeaf;
 
         TreeSplitting::Enum splitting = TreeSplitting::EDensity;
         TreeFilter::Enum filtering = TreeFilter::ENearest;
 
+        /**
+         * Number of threads used to build and refine the child distributions (0 uses all hardware threads).
+         * Only has an effect if the children are distributions themselves.
+         */
+        int threads = 1;
+
         typename Child::Settings child;
     };
 
 private:
-    struct TreeNode {
-        /**
-         * Indexed by a bitstring, where each bit describes the slab for one of the
-         * vector dimensions. Bit 0 means lower half [0, 0.5) and bit 1 means upper half
-         * [0.5, 1.0).
-         * The MSB corresponds to the last dimension of the vector.
-         */
-        std::array<Index, Arity> children;
-        Child value; // the accumulation of the estimator (i.e., sum of integrand*weight)
-        typename Base::ChildData data;
-        
-        GUIDING_CPU_GPU bool isLeaf() const {
-            return children[0] == 0;
-        }
+    struct TreeNode :
+        ChildDensityStorage<TreeNode, Arity, Traits::ChildDensities>,
+        ChildIndexStorage<Index, Arity, Traits::CompactChildren>,
+        SplitStorage<Arity, Traits::PrecomputedSplits>
+    {
+        typedef ChildIndexStorage<Index, Arity, Traits::CompactChildren> Indices;
 
-        GUIDING_CPU_GPU void markAsLeaf() {
-            children[0] = 0;
-        }
+        typename Base::ChildData data;
+        Child value; // the accumulation of the estimator (i.e., sum of integrand*weight)
 
         GUIDING_CPU_GPU int depth(const std::vector<TreeNode, Allocator<TreeNode>> &nodes) const {
-            if (isLeaf())
+            if (this->isLeaf())
                 return 0;
 
             int maxDepth = 0;
             for (int i = 0; i < Arity; ++i)
-                maxDepth = std::max(maxDepth, nodes[children[i]].depth(nodes));
+                maxDepth = std::max(maxDepth, nodes[this->child(i)].depth(nodes));
             return maxDepth + 1;
         }
 
         void write(std::ostream &os) const {
-            guiding::write(os, children);
+            Indices::write(os);
             guiding::write(os, value);
             guiding::write(os, data);
         }
 
         void read(std::istream &is) {
-            guiding::read(is, children);
+            Indices::read(is);
             guiding::read(is, value);
             guiding::read(is, data);
         }
@@ -234,16 +574,82 @@ private:
     using TreeNodeVector = std::vector<TreeNode, Allocator<TreeNode>>;
     TreeNodeVector m_nodes;
 
+    /**
+     * See TreeTraits::GridLevels.
+     */
+    struct GridCell {
+        Index node;
+        uint8_t depth;
+        std::array<uint8_t, Dimension> levels; // the node spans 2^-levels[dim] in each dimension
+    };
+
+    static constexpr int GridResolution = 1 << Traits::GridLevels;
+
+    std::vector<GridCell, Allocator<GridCell>> m_grid;
+
+    /**
+     * See TreeTraits::PyramidLevels. The root is implicit, the cells of the remaining levels are stored one level
+     * after another (the children of cell i are stored at i * Arity in the next level), and m_pyramidNodes holds
+     * the node that each cell of the last level lies in.
+     */
+    std::vector<Float, Allocator<Float>> m_pyramid;
+    std::vector<Index, Allocator<Index>> m_pyramidNodes;
+
+    static_assert(
+        Traits::PyramidLevels == 0 || Arity == (1 << Dimension),
+        "density pyramids require a base that subdivides all dimensions at once (e.g., BTree)"
+    );
+
+    /**
+     * See TreeTraits::AliasTable.
+     */
+    struct AliasEntry {
+        Float threshold; // probability of choosing this entry's leaf over the alias
+        Index alias;
+        Index node;
+        Vector min, size; // the box of the leaf
+    };
+
+    std::vector<AliasEntry, Allocator<AliasEntry>> m_aliasTable;
+
+    StripedAccumulator<Aux, Traits::AccumulatorStripes> m_accumulator;
+
 public:
-    Aux   aux;
-    Float weight;
-    Float density;
+    /**
+     * Trees are never refined beyond this depth, which bounds the traversal stack of TreeFilter::EBox.
+     */
+    static constexpr int MaxDepth = 64;
+
+    // only up to date after build(), see accumulatedAux() and accumulatedWeight()
+    Aux   aux = Aux();
+    Float weight = 0;
+    Float density = 0;
 
     Tree() {
         // haven't learned anything yet, resort to uniform sampling
         setUniform();
     }
 
+    /**
+     * The filtering strategy in effect, see TreeTraits::Filtering.
+     */
+    GUIDING_CPU_GPU static TreeFilter::Enum filtering(const Settings &settings) {
+        if constexpr (Traits::Filtering != TreeFilter::ERuntime)
+            return Traits::Filtering;
+        else
+            return settings.filtering;
+    }
+
+    /**
+     * The splitting strategy in effect, see TreeTraits::Splitting.
+     */
+    GUIDING_CPU_GPU static TreeSplitting::Enum splitting(const Settings &settings) {
+        if constexpr (Traits::Splitting != TreeSplitting::ERuntime)
+            return Traits::Splitting;
+        else
+            return settings.splitting;
+    }
+
     // methods for reading from the tree
 
     GUIDING_CPU_GPU const Child &at(const Settings &, const Vector &x) const {
@@ -276,6 +682,11 @@ public:
     }
 
     GUIDING_CPU_GPU const Child &sample(const Settings &, Float &pdf, Vector &x) const {
+        if constexpr (Traits::AliasTable) {
+            if (!m_aliasTable.empty())
+                return sampleAlias(pdf, x);
+        }
+
         pdf = 1;
 
         Vector base, scale;
@@ -285,8 +696,14 @@ public:
         }
 
         Index index = 0;
+        if constexpr (Traits::PyramidLevels > 0) {
+            if (!m_pyramidNodes.empty())
+                index = pyramidSample(x, base, scale);
+        }
+
         while (!m_nodes[index].isLeaf()) {
-            auto newIndex = m_nodes[index].children[this->sampleChild(x, base, scale, index, m_nodes)];
+            auto &node = m_nodes[index];
+            auto newIndex = node.child(sampleChildOf(node, x, base, scale));
             assert(newIndex > index);
             assert(m_nodes[newIndex].value.density > 0);
             index = newIndex;
@@ -302,6 +719,145 @@ public:
         return m_nodes[index].value;
     }
 
+    // methods for reading from the tree in batches
+
+    /**
+     * Evaluates pdf() for count points at once.
+     * The points (and the parameters for child distributions) are passed as VectorBatch,
+     * the resulting pdfs are written to pdfs[0..count-1].
+     * Traversals of multiple points are interleaved to hide memory latency.
+     */
+    template<typename ...Args>
+    void pdfBatch(const Settings &settings, size_t count, Float *pdfs, const VectorBatch &x, const Args &... params) const {
+        pdfLanes([this](size_t) -> const Tree & { return *this; }, settings, count, pdfs, x, params...);
+    }
+
+    /**
+     * Evaluates sample() for count points at once, see pdfBatch().
+     * Only the vectors that are sampled are modified, i.e., those of the innermost distribution.
+     */
+    template<typename ...Args>
+    void sampleBatch(const Settings &settings, size_t count, Float *pdfs, const VectorBatch &x, const Args &... params) const {
+        sampleLanes([this](size_t) -> const Tree & { return *this; }, settings, count, pdfs, x, params...);
+    }
+
+    /**
+     * Implementation of pdfBatch(), where each point can be looked up in a different tree.
+     * Used by parent distributions to evaluate points in their leaves.
+     * @param trees Functor that returns the tree for the i-th point.
+     */
+    template<typename Trees, typename ...Args>
+    static void pdfLanes(
+        const Trees &trees, const Settings &settings,
+        size_t count, Float *pdfs, const VectorBatch &x, const Args &... params
+    ) {
+        for (size_t start = 0; start < count; start += PacketSize) {
+            int n = int(std::min(count - start, size_t(PacketSize)));
+
+            const Tree *lanes[PacketSize];
+            size_t indices[PacketSize];
+            for (int i = 0; i < n; ++i)
+                lanes[i] = &trees(start + i);
+            indexPacket(lanes, n, x, start, indices);
+
+            if constexpr (!is_empty<Args...>::value) {
+                const Child *children[PacketSize];
+                for (int i = 0; i < n; ++i)
+                    children[i] = &lanes[i]->m_nodes[indices[i]].value;
+                
+                Child::pdfLanes(
+                    [&](size_t i) -> const Child & { return *children[i]; },
+                    settings.child,
+                    n, pdfs + start, offsetBatch(params, start)...
+                );
+            } else {
+                for (int i = 0; i < n; ++i)
+                    pdfs[start + i] = lanes[i]->m_nodes[indices[i]].value.density;
+            }
+        }
+    }
+
+    /**
+     * Implementation of sampleBatch(), see pdfLanes().
+     */
+    template<typename Trees, typename ...Args>
+    static void sampleLanes(
+        const Trees &trees, const Settings &settings,
+        size_t count, Float *pdfs, const VectorBatch &x, const Args &... params
+    ) {
+        for (size_t start = 0; start < count; start += PacketSize) {
+            int n = int(std::min(count - start, size_t(PacketSize)));
+
+            const Tree *lanes[PacketSize];
+            size_t indices[PacketSize];
+            for (int i = 0; i < n; ++i)
+                lanes[i] = &trees(start + i);
+
+            if constexpr (!is_empty<Args...>::value) {
+                // our coordinates are not sampled, the child distributions take care of this
+                indexPacket(lanes, n, x, start, indices);
+
+                const Child *children[PacketSize];
+                for (int i = 0; i < n; ++i)
+                    children[i] = &lanes[i]->m_nodes[indices[i]].value;
+                
+                Child::sampleLanes(
+                    [&](size_t i) -> const Child & { return *children[i]; },
+                    settings.child,
+                    n, pdfs + start, offsetBatch(params, start)...
+                );
+                continue;
+            }
+
+            if constexpr (Traits::AliasTable) {
+                // sampling from alias tables does not traverse, so there are no loads to interleave
+                for (int i = 0; i < n; ++i) {
+                    Vector y;
+                    for (int dim = 0; dim < Dimension; ++dim)
+                        y[dim] = x[dim][start + i];
+                    lanes[i]->sample(settings, pdfs[start + i], y);
+                    for (int dim = 0; dim < Dimension; ++dim)
+                        x[dim][start + i] = y[dim];
+                }
+                continue;
+            }
+
+            Vector local[PacketSize], base[PacketSize], scale[PacketSize];
+            for (int i = 0; i < n; ++i) {
+                indices[i] = 0;
+                for (int dim = 0; dim < Dimension; ++dim) {
+                    local[i][dim] = x[dim][start + i];
+                    base[i][dim] = 0;
+                    scale[i][dim] = 1;
+                }
+
+                if constexpr (Traits::PyramidLevels > 0) {
+                    if (!lanes[i]->m_pyramidNodes.empty())
+                        indices[i] = lanes[i]->pyramidSample(local[i], base[i], scale[i]);
+                }
+            }
+
+            // descend one level for every point in each round
+            for (bool active = true; active;) {
+                active = false;
+                for (int i = 0; i < n; ++i) {
+                    auto &node = lanes[i]->m_nodes[indices[i]];
+                    if (node.isLeaf())
+                        continue;
+                    
+                    indices[i] = node.child(lanes[i]->sampleChildOf(node, local[i], base[i], scale[i]));
+                    active = true;
+                }
+            }
+
+            for (int i = 0; i < n; ++i) {
+                pdfs[start + i] = lanes[i]->m_nodes[indices[i]].value.density;
+                for (int dim = 0; dim < Dimension; ++dim)
+                    x[dim][start + i] = local[i][dim] * scale[i][dim] + base[i][dim];
+            }
+        }
+    }
+
     // methods for writing to the tree
 
     template<typename ...Args>
@@ -310,12 +866,26 @@ public:
         Float density, const AuxWrapper &aux, Float weight,
         const Vector &x, Args&&... params
     ) {
-        this->weight = this->weight + weight;
-        this->aux    = this->aux    + aux.value;
+        splat(settings, ThreadRandom(), density, aux, weight, x, std::forward<Args>(params)...);
+    }
+
+    /**
+     * Splats a sample, drawing the random numbers required by TreeFilter::EStochastic
+     * (for this tree and all nested trees) from the given source.
+     */
+    template<typename Random, typename ...Args>
+    GUIDING_CPU_GPU std::enable_if_t<is_random<Random>::value> splat(
+        const Settings &settings,
+        Random &&random,
+        Float density, const AuxWrapper &aux, Float weight,
+        const Vector &x, Args&&... params
+    ) {
+        m_accumulator.add(weight, aux.value);
 
-        if (settings.filtering == TreeFilter::ENearest) {
+        const auto filter = filtering(settings);
+        if (filter == TreeFilter::ENearest) {
             m_nodes[indexAt(x)].value.splat(
-                settings.child,
+                settings.child, random,
                 density, aux.child, weight,
                 std::forward<Args>(params)...
             );
@@ -327,18 +897,16 @@ public:
         indexAt(x, depth, cellMin, cellMax);
         
         Float volume = 1;
-        Vector originMin, originMax, zero, one;
+        Vector originMin, originMax;
         for (int dim = 0; dim < Dimension; ++dim) {
             Float size = cellMax[dim] - cellMin[dim];
             volume *= size;
 
             originMin[dim] = x[dim] - size/2;
             originMax[dim] = x[dim] + size/2;
-            zero[dim] = 0;
-            one[dim] = 1;
         }
 
-        if (settings.filtering == TreeFilter::EStochastic) {
+        if (filter == TreeFilter::EStochastic) {
             Vector y;
             for (int dim = 0; dim < Dimension; ++dim) {
                 Float alpha = random();
@@ -346,7 +914,7 @@ public:
             }
 
             m_nodes[indexAt(y)].value.splat(
-                settings.child,
+                settings.child, random,
                 density, aux.child, weight,
                 std::forward<Args>(params)...
             );
@@ -354,19 +922,12 @@ public:
             return;
         }
         
-#ifndef __CUDACC__
-        // we currently do not support TreeFilter::EBox in CUDA, since OptiX does
-        // not allow recursion, which is required for splatFiltered to work
-
         splatFiltered(
-            settings,
-            0,
+            settings, random,
             originMin, originMax,
-            zero, one,
             density, aux, weight / volume,
             std::forward<Args>(params)...
         );
-#endif
     }
 
     /**
@@ -376,16 +937,37 @@ public:
      * the mean value over the leaf node size (i.e., its size has been cancelled out).
      */
     GUIDING_CPU_GPU void build(const Settings &settings) {
+        this->weight = accumulatedWeight();
+        this->aux    = accumulatedAux();
+        m_accumulator.clear();
+
         if (this->weight > 1e-8) // @todo
             this->aux = this->aux / this->weight;
 
+        if constexpr (!Child::IsLeaf) {
+            // child distributions are independent of each other, so build them upfront
+            std::vector<std::pair<Index, Float>> leaves;
+            collectLeaves(leaves);
+            parallelFor(leaves.size(), settings.threads, [&](size_t i) {
+                auto &value = m_nodes[leaves[i].first].value;
+                if (!settings.leafReweighting)
+                    value.build(settings.child, leaves[i].second);
+                else
+                    value.build(settings.child);
+            });
+        }
+
+        // nodes are moved out of m_nodes, each of them is visited exactly once
         TreeNodeVector newNodes;
         newNodes.reserve(m_nodes.size());
+        newNodes.push_back(std::move(m_nodes[0]));
 
         bool isValid = build(settings, 0, newNodes);
+        m_nodes.swap(newNodes);
+
         if (
-            newNodes[0].value.weight == 0 ||
-            newNodes[0].value.density == 0 ||
+            m_nodes[0].value.weight == 0 ||
+            m_nodes[0].value.density == 0 ||
             !isValid
         ) {
             // you're building a tree without samples. good luck with that.
@@ -393,14 +975,13 @@ public:
             //    << "/ " << newNodes[0].value.density
             //    << "/" << (isValid ? "valid" : "invalid")
             //    << std::endl;
-            setUniform(newNodes[0].value.weight);
+            setUniform(m_nodes[0].value.weight);
             return;
         }
 
-        //std::cout << "valid tree: " << newNodes[0].value.weight << std::endl;
+        //std::cout << "valid tree: " << m_nodes[0].value.weight << std::endl;
         
         // normalize density
-        m_nodes = newNodes;
         Float norm = m_nodes[0].value.density;
         assert(std::isfinite(norm));
         assert(norm > 0);
@@ -413,6 +994,8 @@ public:
         }
 
         density = norm;
+        updateCaches();
+        updateAliasTable();
     }
 
     void build(const Settings &, Float) {
@@ -421,19 +1004,203 @@ public:
     }
 
     void refine(const Settings &settings) {
-        // @todo could use move constructor for performance and refine directly into other tree
+        constexpr bool NestedBudget = has_node_budget<typename Child::Settings>::value;
+
+        // each split adds Arity nodes to this tree, and Arity - 1 leaves whose children need a root each
+        const size_t maxNodes = std::max<size_t>(settings.maxNodes, 1);
+        const size_t splits = NestedBudget ?
+            (std::max<size_t>(maxNodes, 2) - 2) / (2 * Arity - 1) :
+            (maxNodes - 1) / Arity;
+
+        // nodes are moved out of m_nodes, each of them is visited at most once
         TreeNodeVector newNodes;
         newNodes.reserve(m_nodes.size());
-        refine(settings, m_nodes[0], newNodes);
+        newNodes.push_back(std::move(m_nodes[0]));
 
-        m_nodes = newNodes;
+        std::vector<std::pair<Index, Float>> leaves; // index and criterion
+        refine(settings.maxNodes > 0 ? budgeted(settings, splits) : settings, 0, newNodes, leaves);
 
-        aux = Aux();
+        std::vector<size_t> childBudgets;
+        if constexpr (NestedBudget) {
+            if (settings.maxNodes > 0)
+                childBudgets = apportionBudget(leaves, maxNodes - std::min(maxNodes, newNodes.size()));
+        }
+
+        parallelFor(leaves.size(), Child::IsLeaf ? 1 : settings.threads, [&](size_t i) {
+            auto &value = newNodes[leaves[i].first].value;
+            if constexpr (NestedBudget) {
+                if (!childBudgets.empty()) {
+                    auto childSettings = settings.child;
+                    childSettings.maxNodes = childSettings.maxNodes > 0 ?
+                        std::min(childSettings.maxNodes, childBudgets[i]) :
+                        childBudgets[i];
+                    value.refine(childSettings);
+                    return;
+                }
+            }
+            value.refine(settings.child);
+        });
+
+        m_nodes.swap(newNodes);
+        updateCaches();
+
+        aux = Aux();
+        weight = 0;
+        m_accumulator.clear();
+    }
+
+    /**
+     * Adds the training statistics of another tree, scaled by the given factor.
+     * The trees may be subdivided differently: the statistics of each leaf of other are
+     * distributed over the overlapping leaves of this tree in proportion to their overlap.
+     */
+    void merge(const Tree &other, Float scale = 1) {
+        weight = weight + other.accumulatedWeight() * scale;
+        aux    = aux    + other.accumulatedAux()    * scale;
+
+        other.enumerate([&](const Child &value, const Vector &min, const Vector &max) {
+            Float volume = 1;
+            for (int dim = 0; dim < Dimension; ++dim)
+                volume *= max[dim] - min[dim];
+
+            visitOverlapping(min, max, [&](TreeNode &leaf, Float overlap) {
+                leaf.value.merge(value, scale * overlap / volume);
+            });
+        });
+    }
+
+    /**
+     * Discards the statistics of this tree and all of its nodes, but keeps the topology.
+     * The densities are not meaningful until the tree is built again.
+     */
+    void clearStatistics() {
+        aux = Aux();
         weight = 0;
+        density = 0;
+        m_accumulator.clear();
+
+        for (auto &node : m_nodes)
+            node.value.clearStatistics();
+    }
+
+    /**
+     * Writes the training statistics of this tree in a compact format, which can be used to exchange
+     * statistics between processes (see readStatistics and merge).
+     * Only the topology and the statistics of leaves that received samples are stored.
+     */
+    void writeStatistics(std::ostream &os) const {
+        guiding::write(os, accumulatedAux());
+        guiding::write(os, accumulatedWeight());
+
+        // one flag per node in depth-first order: inner node, empty leaf, or leaf with statistics
+        std::vector<uint8_t> flags;
+        std::vector<const Child *> leaves;
+        std::vector<Index> stack = { 0 };
+        while (!stack.empty()) {
+            auto &node = m_nodes[stack.back()];
+            stack.pop_back();
+
+            if (node.isLeaf()) {
+                bool hasSamples = node.value.hasSamples();
+                flags.push_back(hasSamples ? 2 : 1);
+                if (hasSamples)
+                    leaves.push_back(&node.value);
+                continue;
+            }
+
+            flags.push_back(0);
+            for (int child = Arity - 1; child >= 0; --child)
+                stack.push_back(node.child(child));
+        }
+
+        uint64_t count = flags.size();
+        guiding::write(os, count);
+        os.write((const char *)flags.data(), flags.size());
+
+        for (auto leaf : leaves)
+            leaf->writeStatistics(os);
+    }
+
+    /**
+     * Replaces this tree by the statistics written by writeStatistics.
+     * Only use the result for merging, its densities are not meaningful.
+     */
+    void readStatistics(std::istream &is) {
+        guiding::read(is, aux);
+        guiding::read(is, weight);
+        m_accumulator.clear();
+        density = 0;
+
+        uint64_t count;
+        guiding::read(is, count);
+        std::vector<uint8_t> flags(count);
+        is.read((char *)flags.data(), count);
+
+        // child data is derived the same way refine() does
+        m_nodes.clear();
+        m_nodes.emplace_back();
+
+        size_t flag = 0;
+        std::vector<Index> stack = { 0 };
+        std::vector<Index> leaves;
+        while (!stack.empty()) {
+            Index index = stack.back();
+            stack.pop_back();
+
+            assert(flag < flags.size());
+            if (flags[flag++] != 0) {
+                m_nodes[index].markAsLeaf();
+                if (flags[flag - 1] == 2)
+                    leaves.push_back(index);
+                else
+                    // the defaults of nested distributions are not empty (e.g., a tree has density 1)
+                    m_nodes[index].value.clearStatistics();
+                continue;
+            }
+
+            TreeNode childTemplate = m_nodes[index];
+            this->afterSplit(childTemplate.data);
+            childTemplate.markAsLeaf();
+
+            Index first = m_nodes.size();
+            for (int child = 0; child < Arity; ++child)
+                m_nodes.push_back(childTemplate);
+            m_nodes[index].setChildren(first);
+
+            for (int child = Arity - 1; child >= 0; --child)
+                stack.push_back(first + child);
+        }
+
+        for (auto index : leaves)
+            m_nodes[index].value.readStatistics(is);
+        
+        if (discardIfTooDeep())
+            // like empty leaves, the uniform root must not contribute to merges
+            m_nodes[0].value.clearStatistics();
+        updateCaches();
     }
 
     // methods that provide statistics
 
+    /**
+     * The weight of all samples this tree has received, including those that have not been built yet.
+     */
+    Float accumulatedWeight() const {
+        return weight + m_accumulator.weight();
+    }
+
+    Aux accumulatedAux() const {
+        return aux + m_accumulator.aux();
+    }
+
+    /**
+     * Whether this tree has received samples, including those that have not been built yet.
+     * Use this instead of reading weight, which is only up to date after build().
+     */
+    bool hasSamples() const {
+        return accumulatedWeight() > 0;
+    }
+
     GUIDING_CPU_GPU int depth() const {
         return m_nodes[0].depth(m_nodes);
     }
@@ -457,6 +1224,28 @@ public:
         return count;
     }
 
+    /**
+     * Adds the node counts and memory usage of this tree and its children to stats.
+     * The size of the tree object itself is only taken into account at the top level,
+     * since nested trees are stored within the nodes of their parent.
+     */
+    void collectStatistics(TreeStatistics &stats, size_t level = 0) const {
+        if (stats.nodesPerLevel.size() <= level)
+            stats.nodesPerLevel.resize(level + 1);
+        
+        stats.nodesPerLevel[level] += m_nodes.size();
+        stats.byteSize += m_nodes.capacity() * sizeof(TreeNode);
+        stats.byteSize += m_grid.capacity() * sizeof(GridCell);
+        stats.byteSize += m_pyramid.capacity() * sizeof(Float) + m_pyramidNodes.capacity() * sizeof(Index);
+        stats.byteSize += m_aliasTable.capacity() * sizeof(AliasEntry);
+        if (level == 0)
+            stats.byteSize += sizeof(*this);
+
+        for (auto &node : m_nodes)
+            if (node.isLeaf())
+                node.value.collectStatistics(stats, level + 1);
+    }
+
     void dump(const std::string &prefix) const {
         std::cout << prefix << "Tree (density=" << density << ", weight=" << weight << ")" << std::endl;
         int counter = 16;
@@ -469,41 +1258,455 @@ public:
             std::cout << prefix << "  ... +" << (-counter) << " more leaves" << std::endl;
     }
 
-    void enumerate(
-        std::function<void (const Child &, const Vector &, const Vector &)> callback
-    ) const {
+    /**
+     * Calls visit(leaf, min, max) for every leaf of this tree (in depth-first order), where [min, max) is its box.
+     */
+    template<typename F>
+    void enumerate(F &&visit) const {
         Vector zero, one;
         for (int dim = 0; dim < Dimension; ++dim) {
             zero[dim] = 0;
             one[dim] = 1;
         }
 
-        enumerate(callback, 0, zero, one);
+        enumerate(zero, one, visit);
+    }
+
+    /**
+     * Like enumerate(visit), but only visits the leaves whose box overlaps the query box [min, max].
+     * Subtrees outside of the query box are skipped entirely.
+     */
+    template<typename F>
+    void enumerate(const Vector &min, const Vector &max, F &&visit) const {
+        Vector zero, one;
+        for (int dim = 0; dim < Dimension; ++dim) {
+            zero[dim] = 0;
+            one[dim] = 1;
+        }
+
+        if (overlapsQuery(min, max, zero, one))
+            enumerateSubtree(0, zero, one, min, max, visit);
+    }
+
+    /**
+     * Like enumerate(min, max, visit), but distributes the traversal among the given number of threads
+     * (0 uses all hardware threads). visit is called concurrently and in no particular order.
+     */
+    template<typename F>
+    void enumerate(const Vector &min, const Vector &max, int threads, F &&visit) const {
+        struct Subtree {
+            Index node;
+            Vector min, max;
+        };
+
+        std::vector<Subtree> frontier(1);
+        frontier[0].node = 0;
+        for (int dim = 0; dim < Dimension; ++dim) {
+            frontier[0].min[dim] = 0;
+            frontier[0].max[dim] = 1;
+        }
+
+        if (!overlapsQuery(min, max, frontier[0].min, frontier[0].max))
+            return;
+
+        // split the tree into enough subtrees to keep all threads busy
+        const size_t targetSize = 16 * size_t(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency()));
+        for (bool expanded = true; expanded && frontier.size() < targetSize;) {
+            expanded = false;
+
+            std::vector<Subtree> next;
+            next.reserve(frontier.size() * Arity);
+            for (auto &subtree : frontier) {
+                auto &node = m_nodes[subtree.node];
+                if (node.isLeaf()) {
+                    next.push_back(subtree);
+                    continue;
+                }
+
+                for (int child = 0; child < Arity; ++child) {
+                    Subtree childSubtree = { node.child(child), subtree.min, subtree.max };
+                    this->boxForChild(child, childSubtree.min, childSubtree.max, node.data);
+                    if (overlapsQuery(min, max, childSubtree.min, childSubtree.max))
+                        next.push_back(childSubtree);
+                }
+                expanded = true;
+            }
+            frontier.swap(next);
+        }
+
+        parallelFor(frontier.size(), threads, [&](size_t i) {
+            enumerateSubtree(frontier[i].node, frontier[i].min, frontier[i].max, min, max, visit);
+        });
     }
 
 private:
-    void enumerate(
-        std::function<void (const Child &, const Vector &, const Vector &)> callback,
-        Index index,
-        const Vector &min, const Vector &max
+    /**
+     * Whether the box [nodeMin, nodeMax) of a node overlaps the query box [min, max].
+     */
+    static bool overlapsQuery(const Vector &min, const Vector &max, const Vector &nodeMin, const Vector &nodeMax) {
+        for (int dim = 0; dim < Dimension; ++dim)
+            if (nodeMin[dim] > max[dim] || nodeMax[dim] <= min[dim])
+                return false;
+        return true;
+    }
+
+    /**
+     * Depth-first traversal with an explicit stack, see visitOverlapping.
+     * The box of the given node must overlap the query box.
+     */
+    template<typename F>
+    void enumerateSubtree(
+        Index index, const Vector &nodeMin, const Vector &nodeMax,
+        const Vector &min, const Vector &max,
+        F &visit
     ) const {
+        if (m_nodes[index].isLeaf()) {
+            visit(m_nodes[index].value, nodeMin, nodeMax);
+            return;
+        }
+
+        struct Frame {
+            Index node;
+            int nextChild;
+            Vector min, max;
+        };
+
+        Frame stack[MaxDepth + 1];
+        int stackSize = 0;
+        stack[stackSize++] = { index, 0, nodeMin, nodeMax };
+
+        while (stackSize > 0) {
+            auto &frame = stack[stackSize - 1];
+            if (frame.nextChild == Arity) {
+                --stackSize;
+                continue;
+            }
+
+            auto &node = m_nodes[frame.node];
+            int child = frame.nextChild++;
+
+            Vector childMin = frame.min;
+            Vector childMax = frame.max;
+            this->boxForChild(child, childMin, childMax, node.data);
+            if (!overlapsQuery(min, max, childMin, childMax))
+                continue;
+
+            Index childIndex = node.child(child);
+            auto &childNode = m_nodes[childIndex];
+            if (!childNode.isLeaf()) {
+                assert(stackSize <= MaxDepth);
+                stack[stackSize++] = { childIndex, 0, childMin, childMax };
+                continue;
+            }
+
+            visit(childNode.value, childMin, childMax);
+        }
+    }
+
+    /**
+     * Updates the information that inner nodes store about their children.
+     */
+    void updateCaches() {
+        for (auto &node : m_nodes) {
+            if (node.isLeaf())
+                continue;
+            
+            if constexpr (Traits::ChildDensities) {
+                for (int i = 0; i < Arity; ++i)
+                    node.childDensities[i] = m_nodes[node.child(i)].value.density;
+            }
+
+            if constexpr (Traits::PrecomputedSplits) {
+                this->computeSplits(node.densities(m_nodes.data()), node.splits, node.data);
+            }
+        }
+
+        updateGrid();
+        updatePyramid();
+
+        // densities are only meaningful after build()
+        m_aliasTable.clear();
+    }
+
+    void updateAliasTable() {
+        if constexpr (Traits::AliasTable && Child::IsLeaf) {
+            m_aliasTable.clear();
+
+            // collect the leaves with the probabilities that the descent in sample() would choose them with
+            struct Frame {
+                Index node;
+                Float probability;
+                Vector min, max;
+            };
+
+            std::vector<Frame> stack(1);
+            stack[0].node = 0;
+            stack[0].probability = 1;
+            for (int dim = 0; dim < Dimension; ++dim) {
+                stack[0].min[dim] = 0;
+                stack[0].max[dim] = 1;
+            }
+
+            std::vector<double> probabilities;
+            while (!stack.empty()) {
+                Frame frame = stack.back();
+                stack.pop_back();
+
+                auto &node = m_nodes[frame.node];
+                if (node.isLeaf()) {
+                    AliasEntry entry;
+                    entry.node = frame.node;
+                    for (int dim = 0; dim < Dimension; ++dim) {
+                        entry.min[dim] = frame.min[dim];
+                        entry.size[dim] = frame.max[dim] - frame.min[dim];
+                    }
+                    m_aliasTable.push_back(entry);
+                    probabilities.push_back(frame.probability);
+                    continue;
+                }
+
+                std::array<Float, Arity - 1> splits;
+                this->computeSplits(node.densities(m_nodes.data()), splits, node.data);
+                for (int child = 0; child < Arity; ++child) {
+                    Frame childFrame = { node.child(child), frame.probability, frame.min, frame.max };
+                    childFrame.probability *= this->childProbabilityWithSplits(child, splits, node.data);
+                    this->boxForChild(child, childFrame.min, childFrame.max, node.data);
+                    stack.push_back(childFrame);
+                }
+            }
+
+            // Vose's method
+            size_t count = m_aliasTable.size();
+            double sum = 0;
+            for (auto probability : probabilities)
+                sum += probability;
+
+            std::vector<Index> small, large;
+            for (size_t i = 0; i < count; ++i) {
+                probabilities[i] *= count / sum;
+                (probabilities[i] < 1 ? small : large).push_back(Index(i));
+            }
+
+            while (!small.empty() && !large.empty()) {
+                Index less = small.back();
+                small.pop_back();
+                Index more = large.back();
+
+                m_aliasTable[less].threshold = Float(probabilities[less]);
+                m_aliasTable[less].alias = more;
+
+                probabilities[more] -= 1 - probabilities[less];
+                if (probabilities[more] < 1) {
+                    large.pop_back();
+                    small.push_back(more);
+                }
+            }
+
+            // the remaining entries are (up to rounding) exactly full
+            for (auto &remaining : { small, large }) {
+                for (auto i : remaining) {
+                    m_aliasTable[i].threshold = 1;
+                    m_aliasTable[i].alias = i;
+                }
+            }
+        }
+    }
+
+    GUIDING_CPU_GPU const Child &sampleAlias(Float &pdf, Vector &x) const {
+        Float u = x[0] * m_aliasTable.size();
+        size_t bucket = std::min(size_t(u), m_aliasTable.size() - 1);
+        Float residual = u - bucket;
+
+        const AliasEntry *entry = &m_aliasTable[bucket];
+        if (residual < entry->threshold) {
+            residual /= entry->threshold;
+        } else {
+            residual = (residual - entry->threshold) / (1 - entry->threshold);
+            entry = &m_aliasTable[entry->alias];
+        }
+
+        x[0] = std::min(residual, std::nextafter(Float(1), Float(0)));
+        for (int dim = 0; dim < Dimension; ++dim)
+            x[dim] = entry->min[dim] + x[dim] * entry->size[dim];
+
+        auto &leaf = m_nodes[entry->node].value;
+        pdf = leaf.density;
+        return leaf;
+    }
+
+    void updateGrid() {
+        if constexpr (Traits::GridLevels > 0) {
+            size_t cellCount = 1;
+            for (int dim = 0; dim < Dimension; ++dim)
+                cellCount *= GridResolution;
+            m_grid.resize(cellCount);
+
+            for (size_t cell = 0; cell < cellCount; ++cell) {
+                Vector x, min, max;
+                size_t remainder = cell;
+                for (int dim = 0; dim < Dimension; ++dim) {
+                    x[dim] = (remainder % GridResolution + Float(0.5)) / GridResolution;
+                    remainder /= GridResolution;
+                    min[dim] = 0;
+                    max[dim] = 1;
+                }
+
+                // descend as long as the child still contains the entire cell
+                Index index = 0;
+                int depth = 0;
+                while (!m_nodes[index].isLeaf()) {
+                    auto &node = m_nodes[index];
+                    Vector childX = x, childMin = min, childMax = max;
+                    int childIndex = this->childIndex(childX, node.data);
+                    this->boxForChild(childIndex, childMin, childMax, node.data);
+
+                    bool containsCell = true;
+                    for (int dim = 0; dim < Dimension; ++dim)
+                        containsCell &= childMax[dim] - childMin[dim] >= Float(1) / GridResolution;
+                    if (!containsCell)
+                        break;
+
+                    index = node.child(childIndex);
+                    x = childX;
+                    min = childMin;
+                    max = childMax;
+                    ++depth;
+                }
+
+                auto &entry = m_grid[cell];
+                entry.node = index;
+                entry.depth = uint8_t(depth);
+                for (int dim = 0; dim < Dimension; ++dim)
+                    entry.levels[dim] = uint8_t(-std::ilogb(max[dim] - min[dim]));
+            }
+        }
+    }
+
+    void updatePyramid() {
+        if constexpr (Traits::PyramidLevels > 0 && Child::IsLeaf) {
+            size_t cellCount = 0;
+            size_t lastLevel = 1;
+            for (int level = 1; level <= Traits::PyramidLevels; ++level) {
+                lastLevel *= Arity;
+                cellCount += lastLevel;
+            }
+
+            if (!isSubdivided(0, Traits::PyramidLevels)) {
+                // release the memory, small trees are not worth a pyramid
+                decltype(m_pyramid)().swap(m_pyramid);
+                decltype(m_pyramidNodes)().swap(m_pyramidNodes);
+                return;
+            }
+
+            m_pyramid.resize(cellCount);
+            m_pyramidNodes.resize(lastLevel);
+            fillPyramid(0, 0, 0, 0, Arity);
+        }
+    }
+
+    /**
+     * Whether the given number of levels below m_nodes[index] contain no leaves.
+     */
+    bool isSubdivided(Index index, int levels) const {
+        if (levels == 0)
+            return true;
+
         auto &node = m_nodes[index];
-        if (node.isLeaf()) {
-            callback(node.value, min, max);
+        if (node.isLeaf())
+            return false;
+
+        for (int child = 0; child < Arity; ++child)
+            if (!isSubdivided(node.child(child), levels - 1))
+                return false;
+        return true;
+    }
+
+    /**
+     * Fills the pyramid below the given cell, which lies in m_nodes[index].
+     * The cells of the next level start at childOffset, and that level has childLevelSize cells.
+     */
+    void fillPyramid(Index index, int level, size_t cell, size_t childOffset, size_t childLevelSize) {
+        if (level == Traits::PyramidLevels) {
+            m_pyramidNodes[cell] = index;
             return;
         }
-        
-        for (int childIndex = 0; childIndex < Arity; ++childIndex) {
-            Index ci = node.children[childIndex];
 
-            Vector childMin = min;
-            Vector childMax = max;
-            this->boxForChild(childIndex, childMin, childMax, node.data);
+        auto &node = m_nodes[index];
+        for (int child = 0; child < Arity; ++child) {
+            Index childIndex = node.child(child);
+            size_t childCell = cell * Arity + child;
+
+            m_pyramid[childOffset + childCell] = m_nodes[childIndex].value.density;
+            fillPyramid(childIndex, level + 1, childCell, childOffset + childLevelSize, childLevelSize * Arity);
+        }
+    }
+
+    /**
+     * Samples the top levels of the tree from the pyramid (see TreeTraits::PyramidLevels), transforming
+     * x, base and scale the same way the descent through the nodes would.
+     * @returns The node that the descent continues from.
+     */
+    GUIDING_CPU_GPU Index pyramidSample(Vector &x, Vector &base, Vector &scale) const {
+        size_t cell = 0;
+        size_t offset = 0;
+        size_t levelSize = Arity;
+        for (int level = 0; level < Traits::PyramidLevels; ++level) {
+            std::array<Float, Arity> densities;
+            for (int child = 0; child < Arity; ++child)
+                densities[child] = m_pyramid[offset + cell * Arity + child];
+
+            cell = cell * Arity + this->sampleChild(x, base, scale, densities, typename Base::ChildData());
+            offset += levelSize;
+            levelSize *= Arity;
+        }
+
+        return m_pyramidNodes[cell];
+    }
+
+    /**
+     * Finds the node that a lookup of x can start from, see TreeTraits::GridLevels.
+     * Transforms x into the local coordinates of that node, which gives the same result (bit for bit)
+     * as descending to it through childIndex.
+     */
+    GUIDING_CPU_GPU Index gridLookup(Vector &x, int &depth, Vector &min, Vector &max) const {
+        if constexpr (Traits::GridLevels > 0) {
+            size_t cell = 0;
+            for (int dim = Dimension - 1; dim >= 0; --dim) {
+                int c = int(std::max(x[dim], Float(0)) * GridResolution);
+                cell = cell * GridResolution + std::min(c, GridResolution - 1);
+            }
+
+            auto &entry = m_grid[cell];
+            for (int dim = 0; dim < Dimension; ++dim) {
+                Float scale = Float(1u << entry.levels[dim]);
+                Float t = x[dim] * scale;
+                // points on the upper boundary belong to the last node, as they do in childIndex
+                Float k = std::min(std::max(std::floor(t), Float(0)), scale - 1);
+                x[dim] = t - k;
+                min[dim] = k / scale;
+                max[dim] = (k + 1) / scale;
+            }
 
-            enumerate(callback, ci, childMin, childMax);
+            depth = entry.depth;
+            return entry.node;
+        } else {
+            for (int dim = 0; dim < Dimension; ++dim) {
+                min[dim] = 0;
+                max[dim] = 1;
+            }
+
+            depth = 0;
+            return 0;
         }
     }
 
+    GUIDING_CPU_GPU int sampleChildOf(const TreeNode &node, Vector &x, Vector &base, Vector &scale) const {
+        if constexpr (Traits::PrecomputedSplits)
+            return this->sampleChildWithSplits(x, base, scale, node.splits, node.data);
+        else
+            return this->sampleChild(x, base, scale, node.densities(m_nodes.data()), node.data);
+    }
+
     void setUniform(Float weight = 0) {
         m_nodes.resize(1);
         m_nodes[0].markAsLeaf();
@@ -512,6 +1715,48 @@ private:
         m_nodes[0].value.weight  = weight;
 
         density = 0;
+        updateGrid();
+        updatePyramid();
+        m_aliasTable.clear();
+    }
+
+    /**
+     * Finds the leaves for the points x[..][start..start+n-1], where the
+     * i-th point is looked up in lanes[i].
+     */
+    static void indexPacket(
+        const Tree *const *lanes, int n,
+        const VectorBatch &x, size_t start, size_t *indices
+    ) {
+        Vector local[PacketSize];
+        for (int i = 0; i < n; ++i) {
+            for (int dim = 0; dim < Dimension; ++dim)
+                local[i][dim] = x[dim][start + i];
+
+            int depth;
+            Vector min, max;
+            indices[i] = lanes[i]->gridLookup(local[i], depth, min, max);
+        }
+
+        // descend one level for every point in each round
+        for (bool active = true; active;) {
+            active = false;
+            for (int i = 0; i < n; ++i) {
+                auto &node = lanes[i]->m_nodes[indices[i]];
+                if (node.isLeaf())
+                    continue;
+                
+                indices[i] = node.child(lanes[i]->childIndex(local[i], node.data));
+                active = true;
+            }
+        }
+    }
+
+    template<typename Batch>
+    static Batch offsetBatch(Batch batch, size_t start) {
+        for (auto &component : batch)
+            component += start;
+        return batch;
     }
 
     GUIDING_CPU_GPU size_t indexAt(const Vector &y) const {
@@ -522,18 +1767,12 @@ private:
 
     GUIDING_CPU_GPU size_t indexAt(const Vector &y, int &depth, Vector &min, Vector &max) const {
         Vector x = y;
-        for (int dim = 0; dim < Dimension; ++dim) {
-            min[dim] = 0;
-            max[dim] = 1;
-        }
-
-        Index index = 0;
-        depth = 0;
+        Index index = gridLookup(x, depth, min, max);
         while (!m_nodes[index].isLeaf()) {
             int childIndex = this->childIndex(x, m_nodes[index].data);
             this->boxForChild(childIndex, min, max, m_nodes[index].data);
 
-            auto newIndex = m_nodes[index].children[childIndex];
+            auto newIndex = m_nodes[index].child(childIndex);
             assert(newIndex > index);
             index = newIndex;
 
@@ -543,102 +1782,296 @@ private:
         return index;
     }
 
-    size_t refine(
+    /**
+     * Collects the indices of all leaves in m_nodes, together with the inverse of their volume.
+     */
+    void collectLeaves(std::vector<std::pair<Index, Float>> &leaves) const {
+        std::vector<std::pair<Index, Float>> stack = { { 0, 1 } };
+        while (!stack.empty()) {
+            auto [index, scale] = stack.back();
+            stack.pop_back();
+
+            auto &node = m_nodes[index];
+            if (node.isLeaf()) {
+                leaves.emplace_back(index, scale);
+                continue;
+            }
+
+            for (int i = Arity - 1; i >= 0; --i)
+                stack.emplace_back(node.child(i), scale * Arity);
+        }
+    }
+
+    static Float splitCriterion(const Settings &settings, const Child &value, Float scale) {
+        if (splitting(settings) == TreeSplitting::EWeight)
+            return value.weight;
+        return value.density / scale;
+    }
+
+    struct SplitCandidate {
+        Float key;
+        int depth; // only distinguishes forced splits, whose keys are all infinite
+        size_t splits;
+    };
+
+    /**
+     * Returns settings for which refine makes no more than the given number of splits, by raising
+     * the split threshold (to at least settings.splitThreshold) and, if even the forced splits exceed
+     * the budget, lowering minDepth.
+     * A node can only be split if all its ancestors are split, so each potential split is keyed by the
+     * smallest criterion along its path. Splits are then admitted in order of decreasing key until the
+     * budget is reached.
+     */
+    Settings budgeted(const Settings &settings, size_t budget) const {
+        std::vector<SplitCandidate> candidates;
+        collectSplitCandidates(settings, budget, 0, candidates, std::numeric_limits<Float>::infinity());
+        std::sort(candidates.begin(), candidates.end(), [](const auto &a, const auto &b) {
+            return a.key != b.key ? a.key > b.key : a.depth < b.depth;
+        });
+
+        Settings result = settings;
+        size_t splits = 0;
+        for (size_t i = 0; i < candidates.size();) {
+            // splits with equal keys are either all made or none of them
+            Float key = candidates[i].key;
+            int depth = candidates[i].depth;
+            size_t group = 0;
+            for (; i < candidates.size() && candidates[i].key == key && candidates[i].depth == depth; ++i)
+                group += candidates[i].splits;
+            
+            if (splits + group > budget) {
+                if (depth < settings.minDepth) {
+                    // the forced levels from this depth on do not fit, neither do any optional splits
+                    result.minDepth = depth;
+                    result.splitThreshold = std::numeric_limits<Float>::infinity();
+                } else {
+                    result.splitThreshold = std::max(settings.splitThreshold, std::nextafter(key, std::numeric_limits<Float>::infinity()));
+                }
+                return result;
+            }
+            splits += group;
+        }
+
+        return result;
+    }
+
+    /**
+     * Splits the given number of nodes among the children of the given leaves (with their split criteria).
+     * Every child receives one node for its root, the rest is distributed in proportion to the criteria.
+     */
+    static std::vector<size_t> apportionBudget(const std::vector<std::pair<Index, Float>> &leaves, size_t budget) {
+        Float total = 0;
+        for (auto &leaf : leaves)
+            total += leaf.second;
+
+        const size_t remaining = budget - std::min(budget, leaves.size());
+        std::vector<size_t> result(leaves.size(), 1);
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            Float share = total > 0 ? leaves[i].second / total : Float(1) / leaves.size();
+            result[i] += size_t(share * remaining);
+        }
+        return result;
+    }
+
+    /**
+     * Collects the splits refine would make in the subtree of m_nodes[index] (ignoring the budget),
+     * mirroring its decisions.
+     */
+    void collectSplitCandidates(
+        const Settings &settings, size_t budget, Index index,
+        std::vector<SplitCandidate> &candidates,
+        Float key, int depth = 0, Float scale = 1
+    ) const {
+        auto wouldSplit = [&](Float criterion, int depth) {
+            if (depth >= MaxDepth)
+                return false;
+            return (criterion >= settings.splitThreshold && depth < settings.maxDepth) || depth < settings.minDepth;
+        };
+
+        // forced splits do not limit the keys of their descendants
+        auto keyFor = [&](Float key, Float criterion, int depth) {
+            return depth < settings.minDepth ? key : std::min(key, criterion);
+        };
+
+        auto &node = m_nodes[index];
+        Float criterion = splitCriterion(settings, node.value, scale);
+        if (!wouldSplit(criterion, depth))
+            return;
+        
+        // non-forced splits are only distinguished by their key
+        auto candidateDepth = [&](int depth) {
+            return std::min(depth, settings.minDepth);
+        };
+
+        key = keyFor(key, criterion, depth);
+        candidates.push_back({ key, candidateDepth(depth), 1 });
+
+        if (!node.isLeaf()) {
+            for (int i = 0; i < Arity; ++i)
+                collectSplitCandidates(settings, budget, node.child(i), candidates, key, depth + 1, scale * Arity);
+            return;
+        }
+
+        // the children of a split leaf are identical and receive 1/Arity of its criterion (see refine)
+        size_t multiplicity = Arity;
+        for (++depth; wouldSplit(criterion /= Arity, depth); ++depth) {
+            key = keyFor(key, criterion, depth);
+            candidates.push_back({ key, candidateDepth(depth), multiplicity });
+
+            if (multiplicity > budget)
+                // deeper splits have smaller keys (or deeper forced levels) and can never fit into the budget
+                break;
+            multiplicity *= Arity;
+        }
+    }
+
+    /**
+     * Refines the node that has been placed in newNodes[newIndex].
+     * If it is an inner node, its child indices still refer to m_nodes, whose
+     * children will be moved to newNodes contiguously.
+     * The indices of leaves whose values still need to be refined are appended to leaves,
+     * together with their split criterion.
+     */
+    void refine(
         const Settings &settings,
-        const TreeNode &node, TreeNodeVector &newNodes,
+        size_t newIndex, TreeNodeVector &newNodes,
+        std::vector<std::pair<Index, Float>> &leaves,
         int depth = 0, Float scale = 1
-    ) const {
+    ) {
         assert(newNodes.size() <= std::numeric_limits<Index>::max());
 
-        Index newIndex = newNodes.size();
-        newNodes.push_back(node);
-
-        bool canSplit = (newNodes.size() + Arity) < size_t(std::numeric_limits<Index>::max());
+        bool canSplit = (newNodes.size() + Arity) < size_t(std::numeric_limits<Index>::max()) && depth < MaxDepth;
 
-        Float criterion = node.value.density / scale;
-        if (settings.splitting == TreeSplitting::EWeight)
-            criterion = node.value.weight;
+        auto &node = newNodes[newIndex];
+        Float criterion = splitCriterion(settings, node.value, scale);
         if (
             canSplit && (
                 (criterion >= settings.splitThreshold && depth < settings.maxDepth) ||
                 depth < settings.minDepth
             )
         ) {
+            Index first = newNodes.size();
             if (node.isLeaf()) {
                 // split this node and refine new children recursively
                 // note: once we are in this code region, all recursive calls end
                 // up in this region or the "criterion not met" region.
 
-                TreeNode childTemplate = node;
+                TreeNode childTemplate = std::move(node);
                 childTemplate.value.weight = childTemplate.value.weight / Arity;
                 this->afterSplit(childTemplate.data);
 
-                for (int i = 0; i < Arity; ++i) {
-                    auto newChildIndex = refine(
-                        settings,
-                        childTemplate, newNodes,
-                        depth + 1, scale * Arity
-                    );
-                    newNodes[newIndex].children[i] = newChildIndex;
-                }
-
                 // get rid of wasted space
                 newNodes[newIndex].value = Child();
+
+                for (int i = 1; i < Arity; ++i)
+                    newNodes.push_back(childTemplate);
+                newNodes.push_back(std::move(childTemplate));
             } else {
                 // carry over existing children
-                for (int i = 0; i < Arity; ++i) {
-                    auto newChildIndex = refine(
-                        settings,
-                        m_nodes[node.children[i]], newNodes,
-                        depth + 1, scale * Arity
-                    );
-                    newNodes[newIndex].children[i] = newChildIndex;
-                }
+                std::array<Index, Arity> oldChildren;
+                for (int i = 0; i < Arity; ++i)
+                    oldChildren[i] = node.child(i);
+
+                for (int i = 0; i < Arity; ++i)
+                    newNodes.push_back(std::move(m_nodes[oldChildren[i]]));
             }
+
+            newNodes[newIndex].setChildren(first);
+            for (int i = 0; i < Arity; ++i)
+                refine(settings, first + i, newNodes, leaves, depth + 1, scale * Arity);
         } else {
             // merge (@todo merge distributions?)
-            newNodes[newIndex].markAsLeaf();
-            newNodes[newIndex].value.refine(settings.child);
+            node.markAsLeaf();
+            leaves.emplace_back(Index(newIndex), criterion);
         }
-
-        return newIndex;
     }
 
-    template<typename ...Args>
+    /**
+     * Splats into all leaves that overlap the box [originMin, originMax], weighted by their overlap.
+     */
+    template<typename Random, typename ...Args>
     GUIDING_CPU_GPU void splatFiltered(
         const Settings &settings,
-        Index index,
+        Random &random,
         const Vector &originMin, const Vector &originMax,
-        const Vector &nodeMin, const Vector &nodeMax,
         Float density, const AuxWrapper &aux, Float weight,
         Args&&... params
     ) {
-        Float overlap = computeOverlap<Dimension>(originMin, originMax, nodeMin, nodeMax);
-        if (overlap > 0) {
-            auto &node = m_nodes[index];
-            if (node.isLeaf()) {
-                node.value.splat(
-                    settings.child,
-                    density, aux.child, weight * overlap,
-                    std::forward<Args>(params)...
-                );
-                return;
+        visitOverlapping(originMin, originMax, [&](TreeNode &leaf, Float overlap) {
+            leaf.value.splat(
+                settings.child, random,
+                density, aux.child, weight * overlap,
+                std::forward<Args>(params)...
+            );
+        });
+    }
+
+    /**
+     * Calls visit(leaf, overlap) for all leaves that overlap the box [min, max].
+     * Uses an explicit stack instead of recursion so that it can be used on the GPU (OptiX does
+     * not allow recursion). Subtrees that do not overlap the box are skipped, and the traversal
+     * ends as soon as the entire overlap has been distributed.
+     */
+    template<typename F>
+    GUIDING_CPU_GPU void visitOverlapping(const Vector &min, const Vector &max, F &&visit) {
+        struct Frame {
+            Index node;
+            int nextChild;
+            Vector min, max;
+        };
+
+        Frame stack[MaxDepth + 1];
+        int stackSize = 0;
+
+        auto &root = stack[stackSize++];
+        root.node = 0;
+        root.nextChild = 0;
+        for (int dim = 0; dim < Dimension; ++dim) {
+            root.min[dim] = 0;
+            root.max[dim] = 1;
+        }
+
+        Float remaining = computeOverlap<Dimension>(min, max, root.min, root.max);
+        if (!(remaining > 0))
+            return;
+        
+        if (m_nodes[0].isLeaf()) {
+            visit(m_nodes[0], remaining);
+            return;
+        }
+
+        const Float epsilon = remaining * Float(1e-6);
+        while (stackSize > 0) {
+            auto &frame = stack[stackSize - 1];
+            if (frame.nextChild == Arity) {
+                --stackSize;
+                continue;
             }
 
-            for (int child = 0; child < Arity; ++child) {
-                Vector childMin = nodeMin;
-                Vector childMax = nodeMax;
-                this->boxForChild(child, childMin, childMax, node.data);
-                
-                splatFiltered(
-                    settings,
-                    node.children[child],
-                    originMin, originMax,
-                    childMin, childMax,
-                    density, aux, weight,
-                    std::forward<Args>(params)...
-                );
+            auto &node = m_nodes[frame.node];
+            int child = frame.nextChild++;
+
+            Vector childMin = frame.min;
+            Vector childMax = frame.max;
+            this->boxForChild(child, childMin, childMax, node.data);
+
+            Float overlap = computeOverlap<Dimension>(min, max, childMin, childMax);
+            if (!(overlap > 0))
+                continue;
+            
+            Index childIndex = node.child(child);
+            auto &childNode = m_nodes[childIndex];
+            if (!childNode.isLeaf()) {
+                assert(stackSize <= MaxDepth);
+                stack[stackSize++] = { childIndex, 0, childMin, childMax };
+                continue;
             }
+
+            visit(childNode, overlap);
+
+            remaining -= overlap;
+            if (remaining <= epsilon)
+                return;
         }
     }
 
@@ -649,20 +2082,20 @@ private:
      * After this pass, the density of each node will correspond to the average weight within it,
      * i.e., after this pass you must still normalize the densities.
      */
-    bool build(const Settings &settings, size_t index, TreeNodeVector &newNodes, Float scale = 1) {
-        auto &node = m_nodes[index];
-
-        // insert ourself into the tree
-        Index newIndex = newNodes.size();
-        newNodes.push_back(node);
+    bool build(const Settings &settings, size_t newIndex, TreeNodeVector &newNodes, Float scale = 1) {
+        // we have already been inserted into the tree by our parent,
+        // but our child indices still refer to m_nodes
 
-        if (node.isLeaf()) {
+        if (newNodes[newIndex].isLeaf()) {
             auto &newNode = newNodes[newIndex];
 
-            if (!settings.leafReweighting)
-                newNode.value.build(settings.child, scale);
-            else
-                newNode.value.build(settings.child);
+            // child distributions have already been built by the public build method
+            if constexpr (Child::IsLeaf) {
+                if (!settings.leafReweighting)
+                    newNode.value.build(settings.child, scale);
+                else
+                    newNode.value.build(settings.child);
+            }
 
             if (settings.leafReweighting && newNode.value.weight < 1e-3) { // @todo why 1e-3?
                 // node received too few samples
@@ -674,18 +2107,27 @@ private:
 
         int validCount = 0;
 
+        Index first = newNodes.size();
         {
             // reset parent so we can accumulate children in it
-            auto &node = newNodes[newIndex].value;
-            node.density = 0;
-            node.weight  = 0;
-            node.aux     = typename Child::Aux();
+            auto &node = newNodes[newIndex];
+            node.value.density = 0;
+            node.value.weight  = 0;
+            node.value.aux     = typename Child::Aux();
+
+            std::array<Index, Arity> oldChildren;
+            for (int child = 0; child < Arity; ++child)
+                oldChildren[child] = node.child(child);
+            
+            // insert our children contiguously
+            node.setChildren(first);
+            for (int child = 0; child < Arity; ++child)
+                newNodes.push_back(std::move(m_nodes[oldChildren[child]]));
         }
 
         for (int child = 0; child < Arity; ++child) {
-            auto newChildIndex = newNodes.size();
-            bool isValid = build(settings, node.children[child], newNodes, scale * Arity);
-            newNodes[newIndex].children[child] = newChildIndex;
+            auto newChildIndex = first + child;
+            bool isValid = build(settings, newChildIndex, newNodes, scale * Arity);
 
             if (!isValid && settings.leafReweighting)
                 continue;
@@ -717,7 +2159,7 @@ private:
 
         if (validCount < Arity && settings.mergePartiallyInvalid) {
             // at least one of the node's children is invalid (has not received enough samples)
-            newNodes.resize(newIndex + 1); // remove the subtree of this node...
+            newNodes.resize(first); // remove the subtree of this node...
             newNodes[newIndex].markAsLeaf(); // ...and replace it by a leaf node
 
             // @todo this will break if our children are distributions!
@@ -729,8 +2171,8 @@ private:
 public:
     void write(std::ostream &os) const {
         guiding::write(os, density);
-        guiding::write(os, aux);
-        guiding::write(os, weight);
+        guiding::write(os, accumulatedAux());
+        guiding::write(os, accumulatedWeight());
 
         size_t childCount = m_nodes.size();
         guiding::write(os, childCount);
@@ -742,6 +2184,7 @@ public:
         guiding::read(is, density);
         guiding::read(is, aux);
         guiding::read(is, weight);
+        m_accumulator.clear();
 
         size_t childCount = m_nodes.size();
         guiding::read(is, childCount);
@@ -749,6 +2192,29 @@ public:
 
         for (auto &node : m_nodes)
             node.read(is);
+        
+        discardIfTooDeep();
+        updateCaches();
+        updateAliasTable();
+    }
+
+private:
+    /**
+     * Traversals keep their stack in arrays of MaxDepth + 1 frames (see visitOverlapping). refine never
+     * exceeds this depth, but trees that have been read might, so these are reported and replaced by
+     * a uniform tree without statistics, just like a newly constructed one.
+     * @returns Whether the tree has been replaced.
+     */
+    bool discardIfTooDeep() {
+        if (depth() <= MaxDepth)
+            return false;
+
+        std::cerr << "tree exceeds the maximum depth of " << MaxDepth << " and has been discarded" << std::endl;
+        setUniform();
+        aux = Aux();
+        weight = 0;
+        m_accumulator.clear();
+        return true;
     }
 };
 
@@ -0,0 +1,284 @@
+#ifndef LIBGUIDING_SNAPSHOT_H
+#define LIBGUIDING_SNAPSHOT_H
+
+#include "flat.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define GUIDING_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace guiding {
+
+/**
+ * Binary layout of a snapshot file:
+ * SnapshotHeader, followed by levelCount SnapshotLevels, followed by arrayCount SnapshotArrays,
+ * followed by the contents of the arrays (each aligned to SnapshotAlignment bytes).
+ */
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t floatSize;
+    uint32_t levelCount;
+    uint32_t arrayCount;
+};
+
+struct SnapshotLevel {
+    uint32_t dimension;
+    uint32_t arity;
+    uint32_t auxSize;
+    uint32_t reserved; // keeps the array table aligned
+};
+
+struct SnapshotArray {
+    uint64_t offset;
+    uint64_t count;
+    uint64_t elementSize;
+};
+
+static constexpr char SnapshotMagic[8] = { 'l', 'i', 'b', 'g', 'u', 'i', 'd', 'e' };
+static constexpr uint32_t SnapshotVersion = 1;
+static constexpr uint64_t SnapshotAlignment = 64;
+
+/**
+ * A read-only sampling distribution that is loaded from a snapshot file without deserialization.
+ * On POSIX systems the file is memory mapped (copy-on-write), so loading time does not depend on its size.
+ * The snapshot only stores the flat representation (see Flat), which is accessed through view().
+ * @note Snapshots are not portable between platforms of different endianness or structure layout,
+ * which is detected through the element sizes stored in the file.
+ */
+template<typename D>
+class Snapshot {
+public:
+    typedef D Distribution;
+    typedef Flat<Distribution> FlatDistribution;
+    typedef typename FlatDistribution::View View;
+
+    // the arrays are written and mapped as raw bytes, which must not contain mutexes or locked atomics
+    static_assert(FlatDistribution::IsPlain, "aux types must be Empty, Float or specialize float_components");
+#ifndef __CUDACC__
+    static_assert(std::atomic<Float>::is_always_lock_free, "snapshots require lock-free atomic Floats");
+#endif
+
+    Snapshot() {}
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    ~Snapshot() {
+        close();
+    }
+
+    static void write(std::ostream &os, const Distribution &distribution) {
+        write(os, FlatDistribution(distribution));
+    }
+
+    static void write(std::ostream &os, const FlatDistribution &flat) {
+        std::vector<SnapshotLevel> levels = expectedLevels();
+
+        std::vector<SnapshotArray> arrays;
+        std::vector<const void *> data;
+        flat.forEachArray([&](const void *pointer, size_t count, size_t elementSize) {
+            arrays.push_back({ 0, count, elementSize });
+            data.push_back(pointer);
+        });
+
+        SnapshotHeader header;
+        memcpy(header.magic, SnapshotMagic, sizeof(header.magic));
+        header.version    = SnapshotVersion;
+        header.floatSize  = sizeof(Float);
+        header.levelCount = uint32_t(levels.size());
+        header.arrayCount = uint32_t(arrays.size());
+
+        uint64_t offset = sizeof(header) + levels.size() * sizeof(SnapshotLevel) + arrays.size() * sizeof(SnapshotArray);
+        for (auto &array : arrays) {
+            offset = align(offset);
+            array.offset = offset;
+            offset += array.count * array.elementSize;
+        }
+
+        os.write((const char *)&header, sizeof(header));
+        os.write((const char *)levels.data(), levels.size() * sizeof(SnapshotLevel));
+        os.write((const char *)arrays.data(), arrays.size() * sizeof(SnapshotArray));
+
+        uint64_t position = sizeof(header) + levels.size() * sizeof(SnapshotLevel) + arrays.size() * sizeof(SnapshotArray);
+        const char padding[SnapshotAlignment] = {};
+        for (size_t i = 0; i < arrays.size(); ++i) {
+            os.write(padding, arrays[i].offset - position);
+            os.write((const char *)data[i], arrays[i].count * arrays[i].elementSize);
+            position = arrays[i].offset + arrays[i].count * arrays[i].elementSize;
+        }
+    }
+
+    static bool write(const std::string &path, const Distribution &distribution) {
+        std::ofstream os(path, std::ios::binary);
+        write(os, distribution);
+        return bool(os);
+    }
+
+    /**
+     * Loads a snapshot that has been written by write().
+     * @returns Whether the file could be loaded, errors are reported to std::cerr.
+     */
+    bool load(const std::string &path) {
+        close();
+
+#ifdef GUIDING_HAS_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return fail("could not open " + path);
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return fail("could not determine size of " + path);
+        }
+
+        void *mapping = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+            return fail("could not map " + path);
+
+        m_data = (char *)mapping;
+        m_size = size_t(info.st_size);
+        m_mapped = true;
+#else
+        std::ifstream is(path, std::ios::binary | std::ios::ate);
+        if (!is)
+            return fail("could not open " + path);
+
+        m_size = size_t(is.tellg());
+        m_buffer.resize(m_size + SnapshotAlignment);
+
+        // make sure arrays are aligned the same way they would be in a mapping
+        auto address = (uintptr_t)m_buffer.data();
+        m_data = m_buffer.data() + (align(address) - address);
+
+        is.seekg(0);
+        is.read(m_data, m_size);
+        if (!is)
+            return fail("could not read " + path);
+#endif
+
+        return validate();
+    }
+
+    bool isLoaded() const { return m_data != nullptr; }
+
+    /**
+     * The distribution stored in the snapshot. Do not splat into it.
+     */
+    View view() const {
+        assert(isLoaded());
+        auto arrays = (const SnapshotArray *)(m_data + sizeof(SnapshotHeader) + header().levelCount * sizeof(SnapshotLevel));
+
+        size_t index = 0;
+        return FlatDistribution::viewOf([&]() {
+            return (void *)(m_data + arrays[index++].offset);
+        });
+    }
+
+    const SnapshotHeader &header() const { return *(const SnapshotHeader *)m_data; }
+
+    size_t byteSize() const { return m_size; }
+
+    void close() {
+#ifdef GUIDING_HAS_MMAP
+        if (m_mapped)
+            munmap(m_data, m_size);
+#endif
+        m_buffer.clear();
+        m_data = nullptr;
+        m_size = 0;
+        m_mapped = false;
+    }
+
+private:
+    static uint64_t align(uint64_t offset) {
+        return (offset + SnapshotAlignment - 1) / SnapshotAlignment * SnapshotAlignment;
+    }
+
+    static std::vector<SnapshotLevel> expectedLevels() {
+        std::vector<SnapshotLevel> levels;
+        FlatDistribution::forEachLevel([&](int dimension, int arity, size_t auxSize) {
+            levels.push_back({ uint32_t(dimension), uint32_t(arity), uint32_t(auxSize), 0 });
+        });
+        return levels;
+    }
+
+    bool validate() {
+        if (m_size < sizeof(SnapshotHeader))
+            return fail("snapshot is truncated");
+
+        auto &h = header();
+        if (memcmp(h.magic, SnapshotMagic, sizeof(h.magic)))
+            return fail("not a snapshot");
+        if (h.version != SnapshotVersion)
+            return fail("unsupported snapshot version " + std::to_string(h.version));
+        if (h.floatSize != sizeof(Float))
+            return fail("snapshot uses " + std::to_string(h.floatSize) + " byte floats");
+
+        auto expected = expectedLevels();
+        std::vector<size_t> elementSizes;
+        FlatDistribution().forEachArray([&](const void *, size_t, size_t elementSize) {
+            elementSizes.push_back(elementSize);
+        });
+
+        size_t tableSize = sizeof(SnapshotHeader) + h.levelCount * sizeof(SnapshotLevel) + h.arrayCount * sizeof(SnapshotArray);
+        if (h.levelCount != expected.size() || h.arrayCount != elementSizes.size() || m_size < tableSize)
+            return fail("snapshot does not match the distribution type");
+
+        auto levels = (const SnapshotLevel *)(m_data + sizeof(SnapshotHeader));
+        for (size_t i = 0; i < expected.size(); ++i)
+            if (
+                levels[i].dimension != expected[i].dimension ||
+                levels[i].arity != expected[i].arity ||
+                levels[i].auxSize != expected[i].auxSize
+            )
+                return fail("snapshot does not match the distribution type");
+
+        auto arrays = (const SnapshotArray *)(levels + h.levelCount);
+        for (size_t i = 0; i < elementSizes.size(); ++i) {
+            if (arrays[i].elementSize != elementSizes[i])
+                return fail("snapshot has been written with a different node layout");
+            if (arrays[i].offset % SnapshotAlignment || arrays[i].offset + arrays[i].count * arrays[i].elementSize > m_size)
+                return fail("snapshot is truncated");
+        }
+
+        // a corrupted file must not make traversals leave the arrays
+        size_t index = 0;
+        bool valid = FlatDistribution::validIndices([&]() {
+            auto &array = arrays[index++];
+            return std::pair<const void *, size_t>(m_data + array.offset, array.count);
+        }, 1);
+        if (!valid)
+            return fail("snapshot contains invalid indices");
+
+        return true;
+    }
+
+    bool fail(const std::string &message) {
+        std::cerr << "could not load snapshot: " << message << std::endl;
+        close();
+        return false;
+    }
+
+    char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    std::vector<char> m_buffer;
+};
+
+}
+
+#endif
@@ -36,8 +36,10 @@ struct BTreeBase {
         return childIndex;
     }
 
-    template<typename Node, typename Allocator>
-    GUIDING_CPU_GPU int sampleChild(Vector &x, Vector &base, Vector &scale, int index, const std::vector<Node, Allocator> &nodes) const {
+    GUIDING_CPU_GPU int sampleChild(
+        Vector &x, Vector &base, Vector &scale,
+        const std::array<Float, Arity> &densities, const ChildData &
+    ) const {
         int childIndex = 0;
 
         // sample each axis individually to determine sampled child
@@ -50,7 +52,7 @@ struct BTreeBase {
                 // we are collecting the sum of density for children with
                 // x[dim] = 0 in p[0], and x[dim] = 1 in p[1].
                 int ci = (child << dim) | childIndex;
-                p[child & 1] += nodes[nodes[index].children[ci]].value.density;
+                p[child & 1] += densities[ci];
             }
 
             assert(p[0] >= 0 && p[1] >= 0);
@@ -77,10 +79,87 @@ struct BTreeBase {
 
         return childIndex;
     }
+
+    /**
+     * Computes the probabilities to sample the lower half of each dimension, conditioned on
+     * the halves chosen for the previous dimensions.
+     * For dimension dim and previously chosen bits childIndex, the probability is stored
+     * at splits[(1 << dim) - 1 + childIndex].
+     */
+    GUIDING_CPU_GPU void computeSplits(
+        const std::array<Float, Arity> &densities,
+        std::array<Float, Arity - 1> &splits,
+        const ChildData &
+    ) const {
+        for (int dim = 0; dim < Dimension; ++dim) {
+            for (int childIndex = 0; childIndex < (1 << dim); ++childIndex) {
+                // marginalize over remaining dimensions {dim+1..Dimension-1}, see sampleChild
+                Float p[2] = { 0, 0 };
+                for (int child = 0; child < (1 << (Dimension - dim)); ++child) {
+                    int ci = (child << dim) | childIndex;
+                    p[child & 1] += densities[ci];
+                }
+
+                assert(p[0] >= 0 && p[1] >= 0);
+
+                // combinations that cannot be reached are never sampled
+                splits[(1 << dim) - 1 + childIndex] = (p[0] + p[1]) > 0 ? p[0] / (p[0] + p[1]) : 0.5f;
+            }
+        }
+    }
+
+    GUIDING_CPU_GPU int sampleChildWithSplits(
+        Vector &x, Vector &base, Vector &scale,
+        const std::array<Float, Arity - 1> &splits, const ChildData &
+    ) const {
+        int childIndex = 0;
+
+        for (int dim = 0; dim < Dimension; ++dim) {
+            Float p0 = splits[(1 << dim) - 1 + childIndex];
+
+            int slab = x[dim] >= p0;
+            childIndex |= slab << dim;
+
+            if (slab) {
+                base[dim] += 0.5 * scale[dim];
+                x[dim] = (x[dim] - p0) / (1 - p0);
+            } else
+                x[dim] = x[dim] / p0;
+            scale[dim] /= 2;
+
+            if (x[dim] >= 1)
+                x[dim] = std::nextafterf(1, 0);
+
+            assert(x[dim] >= 0);
+            assert(x[dim] < 1);
+        }
+
+        return childIndex;
+    }
+
+    /**
+     * The probability that sampleChildWithSplits chooses the given child.
+     */
+    GUIDING_CPU_GPU Float childProbabilityWithSplits(
+        int childIndex,
+        const std::array<Float, Arity - 1> &splits,
+        const ChildData &
+    ) const {
+        Float probability = 1;
+        for (int dim = 0; dim < Dimension; ++dim) {
+            Float p0 = splits[(1 << dim) - 1 + (childIndex & ((1 << dim) - 1))];
+            probability *= childIndex & (1 << dim) ? 1 - p0 : p0;
+        }
+        return probability;
+    }
 };
 
-template<int D, typename C = Leaf<Empty>, typename A = Empty, template <typename> class Allocator = std::allocator>
-using BTree = Tree<BTreeBase<D>, C, A, Allocator>;
+template<
+    int D, typename C = Leaf<Empty>, typename A = Empty,
+    template <typename> class Allocator = std::allocator,
+    typename Traits = TreeTraits
+>
+using BTree = Tree<BTreeBase<D>, C, A, Allocator, Traits>;
 
 }
 
@@ -36,21 +36,20 @@ struct KDTreeBase {
         return childIndex;
     }
 
-    template<typename Node, typename Allocator>
-    GUIDING_CPU_GPU int sampleChild(Vector &x, Vector &base, Vector &scale, int index, const std::vector<Node, Allocator> &nodes) const {
+    GUIDING_CPU_GPU int sampleChild(
+        Vector &x, Vector &base, Vector &scale,
+        const std::array<Float, Arity> &densities, const ChildData &data
+    ) const {
         int childIndex = 0;
 
-        Float p[2] = {
-            nodes[nodes[index].children[0]].value.density,
-            nodes[nodes[index].children[1]].value.density
-        };
+        Float p[2] = { densities[0], densities[1] };
 
         assert(p[0] >= 0 && p[1] >= 0);
         assert((p[0] + p[1]) > 0);
         
         p[0] /= p[0] + p[1];
 
-        int dim = nodes[index].data.axis;
+        int dim = data.axis;
         int slab = x[dim] >= p[0];
         childIndex = slab;
 
@@ -69,10 +68,64 @@ struct KDTreeBase {
 
         return childIndex;
     }
+
+    /**
+     * Computes the probability to sample the lower half of the split axis.
+     */
+    GUIDING_CPU_GPU void computeSplits(
+        const std::array<Float, Arity> &densities,
+        std::array<Float, Arity - 1> &splits,
+        const ChildData &
+    ) const {
+        assert(densities[0] >= 0 && densities[1] >= 0);
+
+        Float sum = densities[0] + densities[1];
+        splits[0] = sum > 0 ? densities[0] / sum : 0.5f;
+    }
+
+    GUIDING_CPU_GPU int sampleChildWithSplits(
+        Vector &x, Vector &base, Vector &scale,
+        const std::array<Float, Arity - 1> &splits, const ChildData &data
+    ) const {
+        Float p0 = splits[0];
+
+        int dim = data.axis;
+        int slab = x[dim] >= p0;
+
+        if (slab) {
+            base[dim] += 0.5 * scale[dim];
+            x[dim] = (x[dim] - p0) / (1 - p0);
+        } else
+            x[dim] = x[dim] / p0;
+        scale[dim] /= 2;
+
+        if (x[dim] >= 1)
+            x[dim] = std::nextafterf(1, 0);
+
+        assert(x[dim] >= 0);
+        assert(x[dim] < 1);
+
+        return slab;
+    }
+
+    /**
+     * The probability that sampleChildWithSplits chooses the given child.
+     */
+    GUIDING_CPU_GPU Float childProbabilityWithSplits(
+        int childIndex,
+        const std::array<Float, Arity - 1> &splits,
+        const ChildData &
+    ) const {
+        return childIndex ? 1 - splits[0] : splits[0];
+    }
 };
 
-template<int D, typename C = Leaf<Empty>, typename A = Empty, template <typename> class Allocator = std::allocator>
-using KDTree = Tree<KDTreeBase<D>, C, A, Allocator>;
+template<
+    int D, typename C = Leaf<Empty>, typename A = Empty,
+    template <typename> class Allocator = std::allocator,
+    typename Traits = TreeTraits
+>
+using KDTree = Tree<KDTreeBase<D>, C, A, Allocator, Traits>;
 
 }
 
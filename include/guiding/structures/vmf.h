@@ -0,0 +1,617 @@
+#ifndef LIBGUIDING_STRUCTURES_VMF_H
+#define LIBGUIDING_STRUCTURES_VMF_H
+
+#include "../internal/tree.h"
+#include "../compact.h"
+#include "../flat.h"
+
+#include <cmath>
+
+namespace guiding {
+
+/**
+ * A von Mises-Fisher distribution over the directions of the unit sphere (see jupyter/vmf/VMF.ipynb):
+ * v(w) = kappa / (2 pi (1 - exp(-2 kappa))) * exp(kappa (mean^T w - 1))
+ */
+struct VMFLobe {
+    typedef std::array<Float, 3> Direction;
+
+    static constexpr Float Pi = Float(3.14159265358979323846);
+
+    /**
+     * Lobes that are less sharp are treated as uniform, which avoids the cancellation in their normalization.
+     */
+    static constexpr Float MinKappa = Float(1e-3);
+
+    Direction mean;
+    Float kappa;
+    Float weight; // the probability of choosing this lobe within its mixture
+    Float normalization; // the factor in front of the exponential, see set()
+
+    void set(const Direction &mean, Float kappa, Float weight) {
+        this->mean = mean;
+        this->kappa = kappa;
+        this->weight = weight;
+
+        if (kappa < MinKappa) {
+            this->kappa = 0;
+            normalization = 1 / (4 * Pi);
+        } else
+            normalization = kappa / (2 * Pi * -std::expm1(-2 * kappa));
+    }
+
+    GUIDING_CPU_GPU Float pdf(const Direction &w) const {
+        Float cosine = mean[0] * w[0] + mean[1] * w[1] + mean[2] * w[2];
+        return normalization * std::exp(kappa * (cosine - 1));
+    }
+
+    /**
+     * Maps two uniform random numbers to a direction that is distributed according to this lobe
+     * [Jakob, "Numerically stable sampling of the von Mises Fisher distribution on S^2"].
+     */
+    GUIDING_CPU_GPU Direction sample(Float u, Float v) const {
+        Float cosine = kappa == 0 ?
+            2 * u - 1 :
+            1 + std::log(u + (1 - u) * std::exp(-2 * kappa)) / kappa;
+        cosine = std::min(std::max(cosine, Float(-1)), Float(1));
+
+        Float sine = std::sqrt(std::max(Float(0), 1 - cosine * cosine));
+        Float phi = 2 * Pi * v;
+        Float sinPhi = std::sin(phi);
+        Float cosPhi = std::cos(phi);
+
+        // orthonormal basis around the mean [Duff et al., "Building an Orthonormal Basis, Revisited"]
+        Float sign = std::copysign(Float(1), mean[2]);
+        Float a = -1 / (sign + mean[2]);
+        Float b = mean[0] * mean[1] * a;
+        Direction s = { 1 + sign * mean[0] * mean[0] * a, sign * b, -sign * mean[0] };
+        Direction t = { b, sign + mean[1] * mean[1] * a, -mean[1] };
+
+        Direction w;
+        for (int i = 0; i < 3; ++i)
+            w[i] = sine * (cosPhi * s[i] + sinPhi * t[i]) + cosine * mean[i];
+        return w;
+    }
+};
+
+/**
+ * A mixture of K von Mises-Fisher lobes, which can be used in place of BTree<2> as the directional
+ * distribution of a spatial tree (e.g., KDTree<3, VMFMixture<>>) and only occupies a few hundred bytes.
+ *
+ * Directions are parametrized by the same equal-area square-to-sphere mapping as examples/ppg.h,
+ * i.e., cos(theta) = 2 x[0] - 1 and phi = 2 pi x[1], so the pdf on the square is 4 pi times the pdf on the sphere.
+ *
+ * The mixture is fitted by weighted expectation maximization, with one step per build: splat accumulates
+ * the sufficient statistics of each lobe, weighted by the responsibility of the lobe for the sample under the
+ * current fit, and build re-estimates the lobes from them. Refining keeps the lobes, so the next iteration
+ * continues from the current fit. Until the first fit, the mixture is uniform.
+ */
+template<int K = 4, typename T = Empty>
+class VMFMixture {
+public:
+    // not a leaf, since parent trees leave sampling to us (just as they do with nested trees)
+    static constexpr auto IsLeaf = false;
+    static constexpr int Dimension = 2;
+    static constexpr int LobeCount = K;
+
+    struct Settings {
+        Float resetFactor = 0.f; // see Leaf::Settings
+        Float maxKappa = 10000.f; // the sharpest lobe a fit can produce
+    };
+
+    typedef T Aux;
+    typedef T AuxWrapper;
+    typedef VectorXf<Dimension> Vector;
+    typedef std::array<Float *, Dimension> VectorBatch;
+    typedef std::tuple<Vector> Coordinates;
+    typedef VMFLobe::Direction Direction;
+
+    /**
+     * The component that sample() returns, see RecurseChild.
+     */
+    typedef VMFLobe Child;
+
+    /**
+     * Everything that is needed for sampling and pdf evaluation, see Compact.
+     */
+    struct Parameters {
+        std::array<VMFLobe, K> lobes;
+        bool isFitted = false;
+
+        GUIDING_CPU_GPU Float pdf(const Vector &x) const {
+            if (!isFitted)
+                return 1;
+            return pdf(canonicalToDirection(x));
+        }
+
+        GUIDING_CPU_GPU Float pdf(const Direction &w) const {
+            Float pdf = 0;
+            for (auto &lobe : lobes)
+                if (lobe.weight > 0)
+                    pdf += lobe.weight * lobe.pdf(w);
+            return 4 * VMFLobe::Pi * pdf;
+        }
+
+        /**
+         * x[0] selects the lobe and is then rescaled to sample it, along with x[1].
+         */
+        GUIDING_CPU_GPU const VMFLobe &sample(Float &pdf, Vector &x) const {
+            if (!isFitted) {
+                pdf = 1;
+                return lobes[0];
+            }
+
+            // rounding can leave x[0] beyond the last lobe, which is then chosen
+            int selected = -1;
+            Float begin = 0, end = 0;
+            for (int k = 0; k < K; ++k) {
+                if (!(lobes[k].weight > 0))
+                    continue;
+
+                selected = k;
+                begin = end;
+                end += lobes[k].weight;
+                if (x[0] < end)
+                    break;
+            }
+
+            assert(selected >= 0);
+            auto &lobe = lobes[selected];
+            Float u = (x[0] - begin) / lobe.weight;
+            u = std::min(std::max(u, Float(0)), std::nextafter(Float(1), Float(0)));
+
+            Direction w = lobe.sample(u, x[1]);
+            x = directionToCanonical(w);
+            // evaluate at the returned point rather than at w, so that sample() agrees with pdf() exactly
+            // (sharp lobes amplify the rounding of the mapping by much more than float epsilon)
+            pdf = this->pdf(x);
+            return lobe;
+        }
+    };
+
+    atomic<Aux> aux;
+    atomic<Float> weight;
+    atomic<Float> density;
+
+    VMFMixture() {
+        // spread the lobes evenly over the sphere (spherical Fibonacci points), so that
+        // their responsibilities differ and the first fit can tell them apart
+        const Float goldenAngle = Float(2.39996322972865332);
+        for (int k = 0; k < K; ++k) {
+            Float z = 1 - (2 * k + 1) / Float(K);
+            Float r = std::sqrt(std::max(Float(0), 1 - z * z));
+            Float phi = goldenAngle * k;
+            m_parameters.lobes[k].set({ r * std::cos(phi), r * std::sin(phi), z }, InitialKappa, Float(1) / K);
+        }
+    }
+
+    /**
+     * The equal-area mapping from the unit square to the sphere.
+     */
+    GUIDING_CPU_GPU static Direction canonicalToDirection(const Vector &x) {
+        Float cosTheta = 2 * x[0] - 1;
+        Float sinTheta = std::sqrt(std::max(Float(0), 1 - cosTheta * cosTheta));
+        Float phi = 2 * VMFLobe::Pi * x[1];
+        return { sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta };
+    }
+
+    GUIDING_CPU_GPU static Vector directionToCanonical(const Direction &w) {
+        Float phi = std::atan2(w[1], w[0]);
+        if (phi < 0)
+            phi += 2 * VMFLobe::Pi;
+
+        Vector x;
+        x[0] = std::min(std::max((w[2] + 1) / 2, Float(0)), std::nextafter(Float(1), Float(0)));
+        x[1] = std::min(phi / (2 * VMFLobe::Pi), std::nextafter(Float(1), Float(0)));
+        return x;
+    }
+
+    template<typename Random>
+    GUIDING_CPU_GPU std::enable_if_t<is_random<Random>::value> splat(
+        const Settings &settings, Random &&,
+        Float density, const AuxWrapper &aux, Float weight, const Vector &x
+    ) {
+        splat(settings, density, aux, weight, x);
+    }
+
+    GUIDING_CPU_GPU void splat(const Settings &, Float density, const AuxWrapper &aux, Float weight, const Vector &x) {
+        assert(std::isfinite(density));
+        assert(density >= 0);
+        assert(std::isfinite(weight));
+        assert(weight >= 0);
+
+        this->aux     += aux     * weight;
+        this->density += density * weight;
+        this->weight  += weight;
+
+        Float value = density * weight;
+        if (!(value > 0))
+            return;
+
+        // expectation step: the responsibilities of the lobes for this direction
+        Direction w = canonicalToDirection(x);
+        std::array<Float, K> responsibilities;
+        Float sum = 0;
+        for (int k = 0; k < K; ++k) {
+            auto &lobe = m_parameters.lobes[k];
+            responsibilities[k] = lobe.weight > 0 ? lobe.weight * lobe.pdf(w) : 0;
+            sum += responsibilities[k];
+        }
+
+        if (!(sum > 0))
+            return;
+
+        for (int k = 0; k < K; ++k) {
+            Float share = value * responsibilities[k] / sum;
+            if (share > 0)
+                m_statistics[k] += Statistics { share * w[0], share * w[1], share * w[2], share };
+        }
+    }
+
+    void build(const Settings &settings) {
+        if (weight < 1e-8) // @todo
+            return;
+
+        density = density / weight;
+        aux     = aux     / weight;
+        fit(settings);
+    }
+
+    void build(const Settings &settings, Float scale) {
+        density = density * scale;
+        aux     = aux     * scale;
+        fit(settings);
+    }
+
+    void refine(const Settings &settings) {
+        weight  = weight  * settings.resetFactor;
+        aux     = aux     * weight;
+        density = density * weight;
+
+        for (auto &statistics : m_statistics)
+            statistics = scaled(statistics, weight);
+    }
+
+    /**
+     * Adds the statistics of another mixture, scaled by the given factor.
+     * The lobes of other are ignored, its statistics should have been gathered with the same fit as ours.
+     */
+    void merge(const VMFMixture &other, Float scale = 1) {
+        aux     += T(other.aux) * scale;
+        weight  += Float(other.weight) * scale;
+        density += Float(other.density) * scale;
+
+        for (int k = 0; k < K; ++k)
+            m_statistics[k] += scaled(other.m_statistics[k], scale);
+    }
+
+    /**
+     * Discards the statistics, but keeps the current fit.
+     */
+    void clearStatistics() {
+        aux     = T();
+        weight  = Float(0);
+        density = Float(0);
+
+        for (auto &statistics : m_statistics)
+            statistics = Statistics {};
+    }
+
+    void writeStatistics(std::ostream &os) const {
+        write(os);
+    }
+
+    void readStatistics(std::istream &is) {
+        read(is);
+    }
+
+    /**
+     * Whether this mixture has received samples, see Tree::hasSamples.
+     */
+    bool hasSamples() const {
+        return Float(weight) > 0;
+    }
+
+    GUIDING_CPU_GPU Float pdf(const Settings &, const Vector &x) const {
+        return m_parameters.pdf(x);
+    }
+
+    GUIDING_CPU_GPU const VMFLobe &sample(const Settings &, Float &pdf, Vector &x) const {
+        return m_parameters.sample(pdf, x);
+    }
+
+    /**
+     * Batched pdf evaluation for parent trees, see Tree::pdfLanes.
+     * Evaluating a mixture involves no memory indirections, so points are simply evaluated one after another.
+     */
+    template<typename Mixtures>
+    static void pdfLanes(
+        const Mixtures &mixtures, const Settings &settings,
+        size_t count, Float *pdfs, const VectorBatch &x
+    ) {
+        for (size_t i = 0; i < count; ++i) {
+            Vector y;
+            y[0] = x[0][i];
+            y[1] = x[1][i];
+            pdfs[i] = mixtures(i).pdf(settings, y);
+        }
+    }
+
+    template<typename Mixtures>
+    static void sampleLanes(
+        const Mixtures &mixtures, const Settings &settings,
+        size_t count, Float *pdfs, const VectorBatch &x
+    ) {
+        for (size_t i = 0; i < count; ++i) {
+            Vector y;
+            y[0] = x[0][i];
+            y[1] = x[1][i];
+            mixtures(i).sample(settings, pdfs[i], y);
+            x[0][i] = y[0];
+            x[1][i] = y[1];
+        }
+    }
+
+    const Parameters &parameters() const {
+        return m_parameters;
+    }
+
+    GUIDING_CPU_GPU const atomic<Aux> &estimate() const {
+        return aux;
+    }
+
+    GUIDING_CPU_GPU size_t totalNodeCount() const {
+        return 1;
+    }
+
+    /**
+     * Mixtures are stored within the nodes of their parent, so they only count as a leaf.
+     */
+    void collectStatistics(TreeStatistics &stats, size_t = 0) const {
+        ++stats.leafCount;
+        if (weight == 0)
+            ++stats.emptyLeafCount;
+    }
+
+    void dump(const std::string &prefix) const {
+        std::cout << prefix << "VMFMixture (density=" << density << ", weight=" << weight << ")" << std::endl;
+        if (!m_parameters.isFitted)
+            return;
+
+        for (auto &lobe : m_parameters.lobes)
+            std::cout << prefix << "  lobe (weight=" << lobe.weight << ", kappa=" << lobe.kappa << ", mean="
+                << lobe.mean[0] << " " << lobe.mean[1] << " " << lobe.mean[2] << ")" << std::endl;
+    }
+
+    void write(std::ostream &os) const {
+        guiding::write(os, aux);
+        guiding::write(os, weight);
+        guiding::write(os, density);
+        guiding::write(os, m_parameters);
+        for (auto &statistics : m_statistics)
+            guiding::write(os, statistics);
+    }
+
+    void read(std::istream &is) {
+        guiding::read(is, aux);
+        guiding::read(is, weight);
+        guiding::read(is, density);
+        guiding::read(is, m_parameters);
+        for (auto &statistics : m_statistics)
+            guiding::read(is, statistics);
+    }
+
+private:
+    static constexpr Float InitialKappa = 1;
+
+    /**
+     * The sum of the responsibility-weighted directions (xyz) and the sum of the responsibilities (w).
+     */
+    typedef std::array<Float, 4> Statistics;
+
+    static Statistics scaled(const Statistics &statistics, Float scale) {
+        Statistics result;
+        for (int i = 0; i < 4; ++i)
+            result[i] = statistics[i] * scale;
+        return result;
+    }
+
+    /**
+     * The maximization step, which estimates the lobes from their statistics [Banerjee et al.,
+     * "Clustering on the Unit Hypersphere using von Mises-Fisher Distributions"].
+     * Lobes that did not receive samples keep their mean and sharpness, but drop out of the mixture.
+     */
+    void fit(const Settings &settings) {
+        std::array<Statistics, K> statistics;
+        Float total = 0;
+        for (int k = 0; k < K; ++k) {
+            statistics[k] = m_statistics[k];
+            total += statistics[k][3];
+        }
+
+        if (!(total > 0))
+            // no direction received any contribution, keep the current fit
+            return;
+
+        for (int k = 0; k < K; ++k) {
+            auto &s = statistics[k];
+            auto &lobe = m_parameters.lobes[k];
+            if (!(s[3] > 0)) {
+                lobe.weight = 0;
+                continue;
+            }
+
+            Float length = std::sqrt(s[0] * s[0] + s[1] * s[1] + s[2] * s[2]);
+            if (!(length > 0)) {
+                // perfectly balanced contributions, which only a uniform lobe can explain
+                lobe.set(lobe.mean, 0, s[3] / total);
+                continue;
+            }
+
+            // approximate inversion of the mean resultant length for three dimensions
+            Float r = length / s[3];
+            Float kappa = r < 1 ? (3 * r - r * r * r) / (1 - r * r) : settings.maxKappa;
+            lobe.set(
+                { s[0] / length, s[1] / length, s[2] / length },
+                std::min(kappa, settings.maxKappa),
+                s[3] / total
+            );
+        }
+
+        m_parameters.isFitted = true;
+
+        // keep the statistics per unit of weight, so that refine can rescale them like the others
+        if (weight > 1e-8)
+            for (int k = 0; k < K; ++k)
+                m_statistics[k] = scaled(statistics[k], 1 / Float(weight));
+    }
+
+    Parameters m_parameters;
+    std::array<atomic<Statistics>, K> m_statistics;
+};
+
+/**
+ * Mixtures already are compact, so only their parameters are copied.
+ */
+template<int K, typename T, template<typename> class Allocator>
+class Compact<VMFMixture<K, T>, Allocator> {
+public:
+    typedef VMFMixture<K, T> Distribution;
+    typedef typename Distribution::Settings Settings;
+    typedef typename Distribution::Vector Vector;
+    typedef typename Distribution::Parameters Parameters;
+
+    struct View {
+        const Parameters *mixtures;
+
+        GUIDING_CPU_GPU Float pdf(const Settings &, uint32_t index, const Vector &x) const {
+            return mixtures[index].pdf(x);
+        }
+
+        GUIDING_CPU_GPU void sample(const Settings &, uint32_t index, Float &pdf, Vector &x) const {
+            mixtures[index].sample(pdf, x);
+        }
+    };
+
+    /**
+     * Appends the parameters of the given mixture and returns their index.
+     */
+    uint32_t append(const Distribution &mixture) {
+        m_mixtures.push_back(mixture.parameters());
+        return uint32_t(m_mixtures.size() - 1);
+    }
+
+    size_t byteSize() const {
+        return m_mixtures.size() * sizeof(Parameters);
+    }
+
+    View view() const {
+        return { m_mixtures.data() };
+    }
+
+private:
+    std::vector<Parameters, Allocator<Parameters>> m_mixtures;
+};
+
+/**
+ * Stores copies of the mixtures, see Flat<Leaf<T>>.
+ */
+template<int K, typename T, template<typename> class Allocator>
+class Flat<VMFMixture<K, T>, Allocator> {
+public:
+    typedef VMFMixture<K, T> Distribution;
+    typedef typename Distribution::Settings Settings;
+    typedef typename Distribution::Vector Vector;
+    typedef typename Distribution::AuxWrapper AuxWrapper;
+
+    static constexpr bool IsPlain = is_plain_atomic<T>::value;
+
+    struct View {
+        Distribution *mixtures;
+
+        GUIDING_CPU_GPU const Distribution &at(uint32_t index) const {
+            return mixtures[index];
+        }
+
+        GUIDING_CPU_GPU Float pdf(const Settings &settings, uint32_t index, const Vector &x) const {
+            return mixtures[index].pdf(settings, x);
+        }
+
+        /**
+         * @returns The index of the mixture that has been sampled.
+         */
+        GUIDING_CPU_GPU uint32_t sample(const Settings &settings, uint32_t index, Float &pdf, Vector &x) const {
+            mixtures[index].sample(settings, pdf, x);
+            return index;
+        }
+
+        template<typename Random>
+        GUIDING_CPU_GPU void splat(
+            const Settings &settings, uint32_t index, Random &,
+            Float density, const AuxWrapper &aux, Float weight, const Vector &x
+        ) const {
+            mixtures[index].splat(settings, density, aux, weight, x);
+        }
+    };
+
+    /**
+     * Appends a copy of the given mixture and returns its index.
+     * If training is set, the copy only keeps the fit, but not the statistics of the mixture.
+     */
+    uint32_t append(const Distribution &mixture, bool training) {
+        m_mixtures.push_back(mixture);
+        if (training)
+            m_mixtures.back().clearStatistics();
+        return uint32_t(m_mixtures.size() - 1);
+    }
+
+    /**
+     * Adds the statistics accumulated in the copy at index to mixture.
+     */
+    void gather(Distribution &mixture, uint32_t index) const {
+        mixture.merge(m_mixtures[index]);
+    }
+
+    void resetStatistics() {
+        for (auto &mixture : m_mixtures)
+            mixture.clearStatistics();
+    }
+
+    size_t byteSize() const {
+        return m_mixtures.size() * sizeof(Distribution);
+    }
+
+    View view() {
+        return { m_mixtures.data() };
+    }
+
+    template<typename F>
+    void forEachArray(F &&f) const {
+        f((const void *)m_mixtures.data(), m_mixtures.size(), sizeof(Distribution));
+    }
+
+    /**
+     * Mixtures report zero dimensions like leaves, but their lobe count as arity.
+     */
+    template<typename F>
+    static void forEachLevel(F &&f) {
+        f(0, K, sizeof(T));
+    }
+
+    template<typename F>
+    static View viewOf(F &&next) {
+        return { (Distribution *)next() };
+    }
+
+    template<typename F>
+    static bool validIndices(F &&next, size_t count) {
+        return next().second >= count;
+    }
+
+private:
+    std::vector<Distribution, Allocator<Distribution>> m_mixtures;
+};
+
+}
+
+#endif
@@ -2,17 +2,31 @@
 #define LIBGUIDING_WRAPPER_H
 
 #include "guiding.h"
+#include "compact.h"
 
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <vector>
 #include <fstream>
 #include <cstring>
 #include <cassert>
+#include <cmath>
+#include <limits>
+#include <condition_variable>
 #include <functional>
+#include <memory>
+#include <thread>
+#include <tuple>
 
 #include <mutex>
 #include <shared_mutex>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace guiding {
 
 template<typename T>
@@ -20,26 +34,281 @@ Float defaultTarget(const T &x) {
     return Float(x);
 }
 
-template<typename C, typename S = Float>
+/**
+ * Target policies for Wrapper, which turn samples into the value the distribution is trained on.
+ * RuntimeTarget calls Settings::target, the other policies are inlined.
+ */
+struct RuntimeTarget {};
+
+struct DefaultTarget {
+    template<typename T>
+    Float operator()(const T &x) const {
+        return defaultTarget(x);
+    }
+};
+
+/**
+ * Trains on the average of a spectrum (or any type that offers an average method).
+ */
+struct AverageTarget {
+    template<typename T>
+    Float operator()(const T &x) const {
+        return x.average();
+    }
+};
+
+/**
+ * Returns an identifier that is unique for the lifetime of the process.
+ * Used to tell apart instances in thread-local caches, where addresses might be reused.
+ */
+static inline uint64_t uniqueInstanceId() {
+    static std::atomic<uint64_t> counter(0);
+    return ++counter;
+}
+
+/**
+ * The NUMA node of the CPU the calling thread is running on (0 if this cannot be determined).
+ */
+static inline unsigned currentNumaNode() {
+#ifdef __linux__
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+        return node;
+#endif
+    return 0;
+}
+
+/**
+ * Whether the settings of a distribution contain those of a nested distribution (see Tree::Settings::child),
+ * as opposed to those of the innermost one (e.g., Leaf::Settings).
+ */
+template<typename S, typename = void>
+struct has_child_settings : std::false_type {};
+
+template<typename S>
+struct has_child_settings<S, std::void_t<decltype(std::declval<S &>().child)>> : std::true_type {};
+
+/**
+ * When Wrapper rebuilds its distributions, see Wrapper::Settings::schedule.
+ */
+struct RebuildSchedule {
+    enum Enum {
+        ESamples  = 0, // once the number of samples has grown by a fixed factor
+        ETime     = 1, // in fixed time intervals
+        EVariance = 2, // once the estimate of the current iteration is precise enough
+    };
+};
+
+/**
+ * Who performs rebuilds once they are due, see Wrapper::Settings::trigger.
+ */
+struct RebuildTrigger {
+    enum Enum {
+        EInline = 0, // the thread whose sample made the rebuild due
+        EManual = 1, // the host application, by calling Wrapper::step
+        EThread = 2, // a dedicated thread owned by the wrapper
+    };
+};
+
+template<typename C, typename S = Float, typename T = RuntimeTarget>
 class Wrapper {
 public:
     typedef S Sample;
     typedef C Distribution;
+    typedef T Target;
     typedef typename Distribution::Vector Vector;
+    typedef typename Distribution::VectorBatch VectorBatch;
     typedef typename Distribution::AuxWrapper AuxWrapper;
+    typedef typename Distribution::Coordinates Coordinates;
+    typedef Compact<Distribution> CompactDistribution;
 
     struct Settings {
         Float uniformProb = 0.5f;
 
-        // @todo could enhance performance by adding template for this
+        /**
+         * Only used with RuntimeTarget, see the Target template parameter for a faster alternative.
+         */
         Float (*target)(const Sample &) = defaultTarget<Sample>;
 
+        /**
+         * Number of samples each thread collects in a private buffer before they are
+         * splatted into the training distribution in one batch.
+         * When set to zero, samples are splatted into the training distribution directly.
+         */
+        size_t splatBufferSize = 0;
+
+        /**
+         * Only collects samples in thread-local buffers (regardless of splatBufferSize) and splats all of them
+         * when the distribution is rebuilt, sorted along a Morton curve over all of their coordinates.
+         * The sorted samples are split into deferredThreads contiguous ranges (0 uses all hardware threads),
+         * so that each thread mostly works on its own part of the tree instead of contending for cache lines.
+         * Samples are only visible in training() after the next rebuild, and flush() has no effect.
+         * With asyncRebuild, the samples are sorted and splatted by the background thread.
+         */
+        bool deferredSplatting = false;
+        int deferredThreads = 0;
+
+        /**
+         * Rebuilds the distribution on a background thread instead of stalling all render threads.
+         * Sampling continues from the previous distribution until the new one is published,
+         * and samples that arrive in the meantime are held back in thread-local buffers.
+         */
+        bool asyncRebuild = false;
+
+        /**
+         * ESamples rebuilds once the total number of samples exceeds scheduleSamples, and then whenever
+         * it has grown by scheduleGrowth. ETime rebuilds every scheduleInterval seconds.
+         * EVariance rebuilds once the relative standard error of the iteration's estimate (the mean of
+         * density * weight over its samples) drops below scheduleError, but never later than ESamples would.
+         * Both ETime and EVariance wait for at least scheduleSamples samples per iteration.
+         */
+        RebuildSchedule::Enum schedule = RebuildSchedule::ESamples;
+        size_t scheduleSamples = 1024; // for ESamples, this only takes effect in the constructor and reset()
+        Float scheduleGrowth = 2;
+        Float scheduleInterval = 1;
+        Float scheduleError = 0.01f;
+
+        /**
+         * By default, rebuilds are performed by whichever thread finds that one is due, which stalls that thread.
+         * Use EManual to call step() yourself (e.g., between passes), or EThread to leave this to a dedicated thread.
+         */
+        RebuildTrigger::Enum trigger = RebuildTrigger::EInline;
+
+        /**
+         * Counts how often threads had to wait for the lock that guards the distributions,
+         * see Statistics::sharedLockWaits.
+         */
+        bool countContention = false;
+
+        /**
+         * Samples and evaluates pdfs from a quantized copy of the sampling distribution (see Compact),
+         * whose working set is several times smaller, at the cost of slightly deviating from it.
+         * The full sampling distribution is still kept for sampling(), snapshot() and DeviceWrapper.
+         */
+        bool compactSampling = false;
+
+        /**
+         * Keeps one copy of the sampling distribution per NUMA node, so that threads do not traverse remote memory.
+         * Each copy is made by the first thread of its node that samples after a rebuild, which places it in the memory
+         * of that node (assuming the default first-touch policy). Only supported on Linux, and has no effect on
+         * compactSampling, sampling(), snapshot() and lookup().
+         */
+        bool replicateSampling = false;
+
         typename Distribution::Settings child;
     };
 
+    /**
+     * Describes a single rebuild, see onRebuildStatistics.
+     * Times are wall-clock seconds.
+     */
+    struct Statistics {
+        uint64_t generation = 0; // generation of the distributions that are about to be published
+        size_t samples = 0; // samples received since the previous rebuild
+        size_t samplesSoFar = 0;
+        double splatRate = 0; // samples per second since the previous rebuild
+
+        double buildTime = 0;
+        double copyTime = 0;
+        double refineTime = 0;
+
+        size_t prunedLeaves = 0; // leaves that have been merged by build() because they received too few samples
+
+        TreeStatistics sampling; // the new sampling distribution, its empty leaves did not receive samples in this iteration
+        TreeStatistics training; // the refined training distribution that will receive the samples of the next iteration
+
+        // only collected with Settings::countContention
+        uint64_t sharedLockWaits = 0; // sample, pdf and splat calls that were blocked by a rebuild or a writer
+        uint64_t exclusiveLockWaits = 0;
+
+        size_t compactByteSize = 0; // only with Settings::compactSampling
+    };
+
+    /**
+     * The guiding distribution of the nested dimensions at a fixed point of the outermost ones, see lookup().
+     * It neither takes locks nor is invalidated by rebuilds (it will keep using the previous distribution, though):
+     * the distribution it refers to is pinned by the thread that obtained the lookup, until that thread
+     * obtains its next lookup. Do not keep lookups beyond that or pass them to other threads.
+     */
+    class Lookup {
+    public:
+        typedef typename Distribution::Child Child;
+        typedef typename Child::Vector Vector;
+
+        /**
+         * See Wrapper::sample, with the difference that the uniform selection is made based on x[0] of the nested dimensions.
+         */
+        template<typename ...Args>
+        Float sample(Vector &x, Args&&... params) const {
+            if (m_uniformProb == 1)
+                return 1.f;
+
+            Float pdf = 1 - m_uniformProb; // guiding probability
+            if (x[0] < m_uniformProb) {
+                x[0] /= m_uniformProb;
+                pdf *= guidedPdf(
+                    x,
+                    std::forward<Args>(params)...
+                );
+            } else {
+                x[0] -= m_uniformProb;
+                x[0] /= 1 - m_uniformProb;
+
+                Float gpdf = 1;
+                if (m_compact)
+                    m_compactChild.sample(m_settings, m_compactRoot, gpdf, x, std::forward<Args>(params)...);
+                else
+                    m_child->sample(m_settings, gpdf, x, std::forward<Args>(params)...);
+                pdf *= gpdf;
+            }
+
+            pdf += m_uniformProb;
+            return pdf;
+        }
+
+        template<typename ...Args>
+        Float pdf(Args&&... params) const {
+            if (m_uniformProb == 1)
+                return 1.f;
+
+            return m_uniformProb + (1 - m_uniformProb) * guidedPdf(
+                std::forward<Args>(params)...
+            );
+        }
+
+    private:
+        friend class Wrapper;
+
+        template<typename ...Args>
+        Float guidedPdf(Args&&... params) const {
+            if (m_compact)
+                return m_compactChild.pdf(m_settings, m_compactRoot, std::forward<Args>(params)...);
+            return m_child->pdf(m_settings, std::forward<Args>(params)...);
+        }
+
+        Float m_uniformProb;
+        typename Child::Settings m_settings;
+
+        const Child *m_child = nullptr;
+
+        bool m_compact = false;
+        typename CompactDistribution::ChildCompact::View m_compactChild;
+        uint32_t m_compactRoot = 0;
+    };
+
     Settings settings;
+
+    /**
+     * Called after each rebuild of the distribution.
+     * @note When using Settings::asyncRebuild, this is invoked from the background thread.
+     */
     std::function<void ()> onRebuild;
 
+    /**
+     * Like onRebuild, but receives the statistics of the rebuild, which are only collected if this is set.
+     */
+    std::function<void (const Statistics &)> onRebuildStatistics;
+
     Wrapper() {
         reset();
     }
@@ -49,23 +318,78 @@ public:
         reset();
     }
 
-    void operator=(const Wrapper<S, C> &other) {
+    ~Wrapper() {
+        stopScheduler();
+        waitForRebuild();
+    }
+
+    void operator=(const Wrapper &other) {
+        waitForRebuild();
+        other.waitForRebuild();
+
+        std::unique_lock lock(m_mutex);
+        discardBuffers();
+
         settings   = other.settings;
-        m_sampling = other.m_sampling;
-        m_training = other.m_training;
+        m_sampling = other.m_sampling; // immutable, hence can be shared
+        m_compact  = other.m_compact;
+        m_replicas = {};
+        m_training = std::make_unique<Distribution>(*other.m_training);
+        ++m_generation;
         
         m_samplesSoFar  = other.m_samplesSoFar.load();
         m_nextMilestone = other.m_nextMilestone;
+        m_nextCheck     = other.m_nextCheck.load();
+        m_samplesAtRebuild = other.m_samplesAtRebuild;
+        m_lastRebuild = other.m_lastRebuild;
+        m_estimatesAtRebuild = estimates();
     }
 
     void reset() {
+        waitForRebuild();
+
         std::unique_lock lock(m_mutex);
+        discardBuffers();
 
-        m_training = Distribution();
-        m_sampling = Distribution();
+        m_training = std::make_unique<Distribution>();
+        m_sampling = std::make_shared<const Distribution>();
+        m_compact.reset();
+        m_replicas = {};
+        ++m_generation;
 
-        m_samplesSoFar  = 0;
-        m_nextMilestone = 1024;
+        resetSchedule(0);
+    }
+
+    /**
+     * Like reset(), but continues from a distribution that has been learned before (e.g., for the previous frame
+     * of an animation, stored with Tree::write and loaded with Tree::read), so that guiding is useful right away.
+     * Its statistics are kept for training with their weight scaled by decay (see Leaf::Settings::resetFactor,
+     * which is overridden for all levels), and the schedule continues as if decay * previousSamples samples
+     * had already been received, i.e., the first rebuild happens once the new samples outweigh the old ones.
+     * @param previous A distribution that has been built, such as sampling().
+     */
+    void warmStart(const Distribution &previous, size_t previousSamples, Float decay = 0.5f) {
+        waitForRebuild();
+
+        std::unique_lock lock(m_mutex);
+        discardBuffers();
+
+        // previous may be owned by this wrapper (e.g., sampling()), so copy it before replacing anything
+        auto sampling = std::make_shared<const Distribution>(previous);
+
+        m_sampling = sampling;
+        m_compact.reset();
+        if (settings.compactSampling)
+            m_compact = std::make_shared<const CompactDistribution>(*sampling);
+        m_replicas = {};
+
+        auto refineSettings = settings.child;
+        overrideResetFactor<Distribution>(refineSettings, decay);
+        m_training = std::make_unique<Distribution>(*sampling);
+        m_training->refine(refineSettings);
+        ++m_generation;
+
+        resetSchedule(size_t(decay * previousSamples));
     }
 
     template<typename ...Args>
@@ -73,13 +397,12 @@ public:
         if (settings.uniformProb == 1)
             return 1.f;
         
-        std::shared_lock lock(m_mutex);
+        auto lock = sharedLock();
 
         Float pdf = 1 - settings.uniformProb; // guiding probability
         if (x[0] < settings.uniformProb) {
             x[0] /= settings.uniformProb;
-            pdf *= m_sampling.pdf(
-                settings.child,
+            pdf *= guidedPdf(
                 x,
                 std::forward<Args>(params)...
             );
@@ -88,8 +411,7 @@ public:
             x[0] /= 1 - settings.uniformProb;
 
             Float gpdf = 1;
-            m_sampling.sample(
-                settings.child,
+            guidedSample(
                 gpdf,
                 x,
                 std::forward<Args>(params)...
@@ -106,72 +428,1127 @@ public:
         if (settings.uniformProb == 1)
             return 1.f;
         
-        std::shared_lock lock(m_mutex);
-        return settings.uniformProb + (1 - settings.uniformProb) * m_sampling.pdf(
-            settings.child,
+        auto lock = sharedLock();
+        return settings.uniformProb + (1 - settings.uniformProb) * guidedPdf(
             std::forward<Args>(params)...
         );
     }
 
+    /**
+     * Batched version of sample(), see Tree::sampleBatch().
+     * The vectors (including x) are modified in place and pdfs are written to pdfs[0..count-1].
+     */
+    template<typename ...Args>
+    void sampleBatch(size_t count, Float *pdfs, const VectorBatch &x, const Args &... params) {
+        if (settings.uniformProb == 1) {
+            std::fill(pdfs, pdfs + count, Float(1));
+            return;
+        }
+        
+        // split the batch into points that are sampled uniformly and points that are guided
+        auto &scratch = batchScratch();
+        auto &lanes = scratch.lanes;
+        lanes[0].clear();
+        lanes[1].clear();
+        for (size_t i = 0; i < count; ++i) {
+            Float &u = x[0][i];
+            if (u < settings.uniformProb) {
+                u /= settings.uniformProb;
+                lanes[0].push_back(i);
+            } else {
+                u -= settings.uniformProb;
+                u /= 1 - settings.uniformProb;
+                lanes[1].push_back(i);
+            }
+        }
+
+        constexpr size_t Dimensions = (BatchGather<VectorBatch>::Dimension + ... + BatchGather<Args>::Dimension);
+        scratch.coordinates.resize(Dimensions * count);
+
+        auto lock = sharedLock();
+        for (int guided = 0; guided < 2; ++guided) {
+            auto &indices = lanes[guided];
+            if (indices.empty())
+                continue;
+            
+            auto &gpdfs = scratch.pdfs;
+            gpdfs.resize(indices.size());
+            if (m_compact) {
+                // the compact representation is not vectorized, hence lanes are processed one by one
+                for (size_t i = 0; i < indices.size(); ++i)
+                    processLane(guided, gpdfs[i], indices[i], x, params...);
+            } else {
+                // braced initialization gathers the batches in order, one after another in the scratch memory
+                Float *storage = scratch.coordinates.data();
+                std::tuple<BatchGather<VectorBatch>, BatchGather<Args>...> batches {
+                    BatchGather<VectorBatch>(x, indices, storage),
+                    BatchGather<Args>(params, indices, storage)...
+                };
+
+                std::apply([&](auto &... gathered) {
+                    if (guided)
+                        localSampling().sampleBatch(settings.child, indices.size(), gpdfs.data(), gathered.batch...);
+                    else
+                        localSampling().pdfBatch(settings.child, indices.size(), gpdfs.data(), gathered.batch...);
+                }, batches);
+
+                if (guided) {
+                    std::apply([&](auto &gathered, auto &... gatheredParams) {
+                        gathered.scatter(x, indices);
+                        (gatheredParams.scatter(params, indices), ...);
+                    }, batches);
+                }
+            }
+
+            for (size_t i = 0; i < indices.size(); ++i)
+                pdfs[indices[i]] = settings.uniformProb + (1 - settings.uniformProb) * gpdfs[i];
+        }
+    }
+
+    /**
+     * Batched version of pdf(), see Tree::pdfBatch().
+     */
+    template<typename ...Args>
+    void pdfBatch(size_t count, Float *pdfs, const Args &... params) const {
+        if (settings.uniformProb == 1) {
+            std::fill(pdfs, pdfs + count, Float(1));
+            return;
+        }
+        
+        {
+            auto lock = sharedLock();
+            if (m_compact) {
+                for (size_t i = 0; i < count; ++i)
+                    processLane(false, pdfs[i], i, params...);
+            } else {
+                localSampling().pdfBatch(settings.child, count, pdfs, params...);
+            }
+        }
+
+        for (size_t i = 0; i < count; ++i)
+            pdfs[i] = settings.uniformProb + (1 - settings.uniformProb) * pdfs[i];
+    }
+
+    /**
+     * Resolves the outermost dimensions once, so that the nested ones can be sampled and evaluated
+     * any number of times without locking or traversing the outer tree again (e.g., for MIS).
+     * @code
+     * auto lookup = guiding.lookup(x);
+     * Float pdf = lookup.sample(d);
+     * Float bsdfPdf = lookup.pdf(bsdfDirection);
+     * @endcode
+     */
+    Lookup lookup(const Vector &x) const {
+        static_assert(!Distribution::Child::IsLeaf, "lookups require nested distributions");
+
+        Lookup lookup;
+        lookup.m_uniformProb = settings.uniformProb;
+        lookup.m_settings = settings.child.child;
+
+        const LookupPin *pin;
+        {
+            auto lock = sharedLock();
+            pin = &pinDistributions();
+        }
+
+        lookup.m_child = &pin->sampling->at(settings.child, x);
+        if (pin->compact) {
+            auto view = pin->compact->view();
+            lookup.m_compact = true;
+            lookup.m_compactChild = view.child;
+            lookup.m_compactRoot = view.childAt(0, x);
+        }
+        return lookup;
+    }
+
     template<typename ...Args>
     void splat(const Sample &sample, const AuxWrapper &aux, Float weight, Args&&... params) {
+        splat(ThreadRandom(), sample, aux, weight, std::forward<Args>(params)...);
+    }
+
+    /**
+     * Splats a sample, drawing the random numbers required by stochastic filtering from the given source
+     * (e.g., your per-pixel sampler), which makes training reproducible.
+     * Buffered samples only draw a single number to seed the generator that is used once they are splatted.
+     */
+    template<typename Random, typename ...Args>
+    std::enable_if_t<is_random<Random>::value> splat(
+        Random &&random,
+        const Sample &sample, const AuxWrapper &aux, Float weight,
+        Args&&... params
+    ) {
         //if (settings.uniformProb == 1)
         //    return;
         
-        {
-            Float density = settings.target(sample);
-            assert(std::isfinite(density));
-            assert(density >= 0);
-            assert(std::isfinite(weight));
-            assert(weight >= 0);
+        Float density = evaluateTarget(sample);
+        assert(std::isfinite(density));
+        assert(density >= 0);
+        assert(std::isfinite(weight));
+        assert(weight >= 0);
 
-            std::shared_lock lock(m_mutex);
-            m_training.splat(
-                settings.child,
+        if (settings.schedule == RebuildSchedule::EVariance)
+            threadBuffer().estimates.add(density * weight);
+
+        if (settings.deferredSplatting) {
+            auto &buffer = threadBuffer();
+            {
+                std::unique_lock lock(buffer.mutex);
+                buffer.records.push_back({
+                    density, aux, weight,
+                    SeededRandom::seed(random()),
+                    Coordinates { std::forward<Args>(params)... }
+                });
+            }
+
+            if (++m_samplesSoFar > m_nextCheck)
+                checkSchedule();
+            return;
+        }
+
+        if (settings.splatBufferSize == 0) {
+            auto lock = sharedLock();
+            if (!m_rebuilding) {
+                m_training->splat(
+                    settings.child, random,
+                    density, aux, weight,
+                    std::forward<Args>(params)...
+                );
+                lock.unlock();
+
+                if (++m_samplesSoFar > m_nextCheck) {
+                    // it's wednesday my dudes!
+                    checkSchedule();
+                }
+                return;
+            }
+
+            // the training distribution is currently being rebuilt,
+            // hold the sample back until the new one is published
+        }
+
+        auto &buffer = threadBuffer();
+        {
+            std::unique_lock lock(buffer.mutex);
+            buffer.records.push_back({
                 density, aux, weight,
-                std::forward<Args>(params)...
-            );
+                SeededRandom::seed(random()),
+                Coordinates { std::forward<Args>(params)... }
+            });
+
+            if (buffer.records.size() < settings.splatBufferSize || m_rebuilding)
+                return;
         }
 
-        if (++m_samplesSoFar > m_nextMilestone) {
-            // it's wednesday my dudes!
-            step();
+        flushBuffer(buffer);
+    }
+
+    /**
+     * Splats all samples that are still pending in thread-local buffers
+     * into the training distribution.
+     * Call this at the end of a rendering pass if you are using Settings::splatBufferSize.
+     */
+    void flush() {
+        if (settings.deferredSplatting)
+            // samples are splatted in step(), and have already been counted
+            return;
+
+        {
+            auto lock = sharedLock();
+            if (m_rebuilding)
+                // the pending samples will be splatted once the rebuild is done
+                return;
+            
+            std::unique_lock buffersLock(m_buffersMutex);
+            for (auto &buffer : m_buffers) {
+                std::unique_lock bufferLock(buffer->mutex);
+                splatRecords(buffer->records);
+                m_samplesSoFar += buffer->records.size();
+                buffer->records.clear();
+            }
         }
+
+        if (m_samplesSoFar > m_nextCheck)
+            checkSchedule();
+    }
+
+    /**
+     * Blocks until a rebuild that is running in the background has been published.
+     */
+    void waitForRebuild() const {
+        std::unique_lock lock(m_rebuildThreadMutex);
+        if (m_rebuildThread.joinable())
+            m_rebuildThread.join();
     }
 
+    /**
+     * Returns whether a rebuild is currently running in the background.
+     */
+    bool isRebuilding() const { return m_rebuilding; }
+
     size_t samplesSoFar() const { return m_samplesSoFar; }
 
-    Distribution &training() { return m_training; }
-    const Distribution &training() const { return m_training; }
+    /**
+     * Waits for a rebuild that is running in the background (see waitForRebuild()),
+     * which owns the training distribution until it is done.
+     */
+    Distribution &training() {
+        waitForRebuild();
+        assert(m_training);
+        return *m_training;
+    }
 
-    Distribution &sampling() { return m_sampling; }
-    const Distribution &sampling() const { return m_sampling; }
+    const Distribution &training() const {
+        waitForRebuild();
+        assert(m_training);
+        return *m_training;
+    }
 
-private:
-    void step() {
-        std::unique_lock lock(m_mutex);
-        if (m_samplesSoFar < m_nextMilestone)
+    const Distribution &sampling() const { return *m_sampling; }
+
+    /**
+     * Increases every time new sampling and training distributions are published.
+     */
+    uint64_t generation() const {
+        std::shared_lock lock(m_mutex);
+        return m_generation;
+    }
+
+    /**
+     * Calls f(sampling, training) while neither of them can be replaced (e.g., to copy them to the GPU),
+     * waiting for a background rebuild to finish first.
+     * @returns The generation of the distributions that have been passed to f.
+     */
+    template<typename F>
+    uint64_t snapshot(F &&f) const {
+        while (true) {
+            waitForRebuild();
+
+            std::shared_lock lock(m_mutex);
+            if (m_rebuilding)
+                // someone started the next rebuild in the meantime
+                continue;
+            
+            f(*m_sampling, *m_training);
+            return m_generation;
+        }
+    }
+
+    /**
+     * Adds samples that have been accumulated outside of the wrapper (e.g., on the GPU, see DeviceWrapper)
+     * by calling gather(training), and advances the schedule by sampleCount samples.
+     * If the distributions have been replaced since the given generation, the samples no longer
+     * fit the training distribution and are dropped.
+     * @returns Whether the samples have been added.
+     */
+    template<typename F>
+    bool gatherTraining(size_t sampleCount, uint64_t generation, F &&gather) {
+        {
+            std::unique_lock lock(m_mutex);
+            if (m_rebuilding || generation != m_generation)
+                return false;
+            
+            gather(*m_training);
+            m_samplesSoFar += sampleCount;
+        }
+
+        if (m_samplesSoFar > m_nextCheck)
+            checkSchedule();
+        return true;
+    }
+
+    /**
+     * Adds the training statistics of another distribution (e.g., one learned by another process,
+     * see Tree::readStatistics), which may be subdivided differently, and advances the schedule
+     * by sampleCount samples. Waits for a background rebuild to finish first.
+     */
+    void mergeTraining(const Distribution &other, size_t sampleCount) {
+        while (true) {
+            waitForRebuild();
+
+            std::unique_lock lock(m_mutex);
+            if (m_rebuilding)
+                continue;
+            
+            m_training->merge(other);
+            m_samplesSoFar += sampleCount;
+            break;
+        }
+
+        if (m_samplesSoFar > m_nextCheck)
+            checkSchedule();
+    }
+
+    /**
+     * Returns whether the schedule asks for a rebuild (see Settings::schedule).
+     */
+    bool rebuildDue() const {
+        std::shared_lock lock(m_mutex);
+        return !m_rebuilding && isDue();
+    }
+
+    /**
+     * Rebuilds the distributions if a rebuild is due.
+     * This is called automatically unless you use RebuildTrigger::EManual, in which case you should call
+     * it regularly (e.g., after each pass).
+     * @returns Whether a rebuild has been performed (or started, when using Settings::asyncRebuild).
+     */
+    bool step() {
+        auto lock = exclusiveLock();
+        if (m_rebuilding || !isDue())
             // someone was here before us!
+            return false;
+        
+        // make sure samples that are still waiting in buffers are not lost
+        // (deferred samples are only taken out here and splatted by whoever rebuilds)
+        DeferredRecords deferred;
+        if (settings.deferredSplatting)
+            deferred = takeDeferred();
+        else
+            drainBuffers();
+
+        // a background rebuild might have taken longer than the previous iteration,
+        // in which case more samples than expected have already arrived
+        m_nextMilestone = size_t(settings.scheduleGrowth * std::max<size_t>(m_nextMilestone, m_samplesSoFar));
+
+        Statistics stats = beginStatistics();
+        m_estimatesAtRebuild = estimates();
+        m_nextCheck = nextCheck();
+
+        if (!settings.asyncRebuild) {
+            splatDeferred(*m_training, deferred);
+            m_sampling = rebuild(*m_training, stats, m_compact);
+            m_replicas = {};
+            ++m_generation;
+            return true;
+        }
+
+        m_rebuilding = true;
+
+        std::unique_lock threadLock(m_rebuildThreadMutex);
+        if (m_rebuildThread.joinable())
+            // the previous rebuild has already been published, the thread is just about to exit
+            m_rebuildThread.join();
+        
+        m_rebuildThread = std::thread([
+            this, training = std::move(m_training), deferred = std::move(deferred), stats
+        ]() mutable {
+            // only this thread owns the training distribution, so render threads are not stalled
+            splatDeferred(*training, deferred);
+            deferred = {};
+
+            std::shared_ptr<const CompactDistribution> compact;
+            auto sampling = rebuild(*training, stats, compact);
+
+            auto lock = exclusiveLock();
+            m_training = std::move(training);
+            std::swap(m_sampling, sampling);
+            std::swap(m_compact, compact);
+            Replicas replicas;
+            std::swap(m_replicas, replicas);
+            ++m_generation;
+            m_rebuilding = false;
+
+            if (!settings.deferredSplatting)
+                // deferred samples remain buffered until the next rebuild
+                drainBuffers();
+            lock.unlock();
+
+            // the previous sampling distribution is released outside of the lock
+            sampling.reset();
+            compact.reset();
+            replicas = {};
+        });
+        return true;
+    }
+
+private:
+    /**
+     * Number of samples after which time and variance based schedules are consulted again.
+     */
+    static constexpr size_t ScheduleCheckInterval = 4096;
+
+    Float evaluateTarget(const Sample &sample) const {
+        if constexpr (std::is_same<Target, RuntimeTarget>::value)
+            return settings.target(sample);
+        else
+            return Target()(sample);
+    }
+
+    /**
+     * The distributions that the lookups of the calling thread refer to, see Lookup.
+     */
+    struct LookupPin {
+        uint64_t id;
+        uint64_t generation;
+        std::shared_ptr<const Distribution> sampling;
+        std::shared_ptr<const CompactDistribution> compact;
+    };
+
+    /**
+     * Pins the current distributions for the calling thread, which only copies ownership once per generation
+     * instead of for every lookup. Pins of previous generations are released by the next lookup.
+     * Requires m_mutex to be held.
+     */
+    const LookupPin &pinDistributions() const {
+        // threads might work with multiple wrappers, see threadBuffer
+        constexpr size_t MaxCacheEntries = 8;
+        thread_local std::vector<LookupPin> pins;
+        LookupPin *pin = nullptr;
+        for (auto &candidate : pins)
+            if (candidate.id == m_id)
+                pin = &candidate;
+        
+        if (!pin) {
+            if (pins.size() >= MaxCacheEntries)
+                pins.erase(pins.begin());
+            pin = &pins.emplace_back(LookupPin { m_id, 0, nullptr, nullptr });
+        } else if (pin->generation == m_generation && pin->sampling) {
+            return *pin;
+        }
+
+        pin->generation = m_generation;
+        pin->sampling = m_sampling;
+        pin->compact = m_compact;
+        return *pin;
+    }
+
+    /**
+     * The sampling distribution to be used by the calling thread, see Settings::replicateSampling.
+     * Requires m_mutex to be held.
+     */
+    const Distribution &localSampling() const {
+        if (!settings.replicateSampling)
+            return *m_sampling;
+
+        struct CacheEntry {
+            uint64_t id;
+            uint64_t generation;
+            const Distribution *replica;
+        };
+
+        // threads might work with multiple wrappers, see threadBuffer
+        // (entries of wrappers that have been destroyed are never matched again, so the oldest are dropped)
+        constexpr size_t MaxCacheEntries = 8;
+        thread_local std::vector<CacheEntry> cache;
+        CacheEntry *entry = nullptr;
+        for (auto &candidate : cache)
+            if (candidate.id == m_id)
+                entry = &candidate;
+        
+        if (entry && entry->generation == m_generation)
+            // replicas are only replaced together with the generation
+            return *entry->replica;
+        if (!entry) {
+            if (cache.size() >= MaxCacheEntries)
+                cache.erase(cache.begin());
+            entry = &cache.emplace_back(CacheEntry { m_id, 0, nullptr });
+        }
+
+        auto &replica = m_replicas[currentNumaNode() % m_replicas.size()];
+        {
+            std::unique_lock lock(m_replicasMutex);
+            if (!replica)
+                replica = std::make_unique<const Distribution>(*m_sampling);
+        }
+
+        entry->generation = m_generation;
+        entry->replica = replica.get();
+        return *replica;
+    }
+
+    /**
+     * Evaluates the guiding pdf, using the compact representation if available.
+     * Requires m_mutex to be held.
+     */
+    template<typename ...Args>
+    Float guidedPdf(Args&&... params) const {
+        if (m_compact)
+            return m_compact->view().pdf(settings.child, 0, std::forward<Args>(params)...);
+        return localSampling().pdf(settings.child, std::forward<Args>(params)...);
+    }
+
+    template<typename ...Args>
+    void guidedSample(Float &pdf, Args&&... params) const {
+        if (m_compact)
+            m_compact->view().sample(settings.child, 0, pdf, std::forward<Args>(params)...);
+        else
+            localSampling().sample(settings.child, pdf, std::forward<Args>(params)...);
+    }
+
+    template<typename Batch>
+    static VectorXf<std::tuple_size<Batch>::value> laneOf(const Batch &batch, size_t index) {
+        VectorXf<std::tuple_size<Batch>::value> result;
+        for (size_t dim = 0; dim < std::tuple_size<Batch>::value; ++dim)
+            result[dim] = batch[dim][index];
+        return result;
+    }
+
+    template<typename Batch>
+    static void storeLane(const Batch &batch, size_t index, const VectorXf<std::tuple_size<Batch>::value> &value) {
+        for (size_t dim = 0; dim < std::tuple_size<Batch>::value; ++dim)
+            batch[dim][index] = value[dim];
+    }
+
+    /**
+     * Samples (or evaluates the pdf of) a single lane of a batch through guidedSample (or guidedPdf).
+     */
+    template<typename ...Batches>
+    void processLane(bool sample, Float &pdf, size_t index, const Batches &... batches) const {
+        auto lane = std::make_tuple(laneOf(batches, index)...);
+        std::apply([&](auto &... values) {
+            if (!sample) {
+                pdf = guidedPdf(values...);
+                return;
+            }
+
+            guidedSample(pdf, values...);
+            (storeLane(batches, index, values), ...);
+        }, lane);
+    }
+
+    /**
+     * Copies a subset of a batch into contiguous storage.
+     */
+    template<typename Batch>
+    struct BatchGather {
+        static constexpr size_t Dimension = std::tuple_size<Batch>::value;
+
+        Batch batch;
+
+        /**
+         * Gathers the given lanes of source into storage, which is advanced past the gathered values.
+         */
+        BatchGather(const Batch &source, const std::vector<size_t> &indices, Float *&storage) {
+            for (size_t dim = 0; dim < Dimension; ++dim) {
+                batch[dim] = storage;
+                storage += indices.size();
+                for (size_t i = 0; i < indices.size(); ++i)
+                    batch[dim][i] = source[dim][indices[i]];
+            }
+        }
+
+        void scatter(const Batch &target, const std::vector<size_t> &indices) const {
+            for (size_t dim = 0; dim < Dimension; ++dim)
+                for (size_t i = 0; i < indices.size(); ++i)
+                    target[dim][indices[i]] = batch[dim][i];
+        }
+    };
+
+    /**
+     * Memory that sampleBatch reuses across calls, so that batches do not allocate once it has grown.
+     */
+    struct BatchScratch {
+        std::vector<size_t> lanes[2]; // uniformly sampled and guided lanes
+        std::vector<Float> pdfs;
+        std::vector<Float> coordinates; // see BatchGather
+    };
+
+    static BatchScratch &batchScratch() {
+        // does not depend on the wrapper, hence shared by all of them
+        thread_local BatchScratch scratch;
+        return scratch;
+    }
+
+    /**
+     * Moments of density * weight over samples, see RebuildSchedule::EVariance.
+     */
+    struct Moments {
+        size_t count = 0;
+        double sum = 0;
+        double sumSquares = 0;
+    };
+
+    /**
+     * Moments of all samples a single thread has splatted.
+     * Only the owning thread writes, so no read-modify-write operations are needed.
+     */
+    struct MomentAccumulator {
+        std::atomic<size_t> count = 0;
+        std::atomic<double> sum = 0;
+        std::atomic<double> sumSquares = 0;
+
+        void add(double estimate) {
+            count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            sum.store(sum.load(std::memory_order_relaxed) + estimate, std::memory_order_relaxed);
+            sumSquares.store(sumSquares.load(std::memory_order_relaxed) + estimate * estimate, std::memory_order_relaxed);
+        }
+    };
+
+    struct SplatRecord {
+        Float density;
+        AuxWrapper aux;
+        Float weight;
+        uint32_t seed;
+        Coordinates coordinates;
+    };
+
+    /**
+     * Samples collected by a single thread.
+     * Aligned to cache lines so that threads do not interfere with each other while splatting.
+     */
+    struct alignas(64) SplatBuffer {
+        std::thread::id owner;
+        std::mutex mutex;
+        std::vector<SplatRecord> records; // guarded by mutex
+        std::vector<SplatRecord> flushing; // only accessed by the owning thread
+        MomentAccumulator estimates;
+    };
+
+    SplatBuffer &threadBuffer() {
+        // threads might work with multiple wrappers, so we need to look up the right buffer
+        // (entries of wrappers that have been destroyed are never matched again, so the oldest are dropped)
+        constexpr size_t MaxCacheEntries = 8;
+        thread_local std::vector<std::pair<uint64_t, SplatBuffer *>> cache;
+        for (auto &entry : cache)
+            if (entry.first == m_id)
+                return *entry.second;
+        
+        std::unique_lock lock(m_buffersMutex);
+        SplatBuffer *buffer = nullptr;
+        for (auto &candidate : m_buffers)
+            if (candidate->owner == std::this_thread::get_id())
+                // our entry has been dropped from the cache before
+                buffer = candidate.get();
+        
+        if (!buffer) {
+            m_buffers.push_back(std::make_unique<SplatBuffer>());
+            buffer = m_buffers.back().get();
+            buffer->owner = std::this_thread::get_id();
+            buffer->records.reserve(settings.splatBufferSize);
+            buffer->flushing.reserve(settings.splatBufferSize);
+        }
+
+        if (cache.size() >= MaxCacheEntries)
+            cache.erase(cache.begin());
+        cache.emplace_back(m_id, buffer);
+        return *buffer;
+    }
+
+    void flushBuffer(SplatBuffer &buffer) {
+        {
+            auto lock = sharedLock();
+            if (m_rebuilding)
+                return;
+
+            {
+                // hand the full buffer over to ourselves, so that we can
+                // continue to fill it while we are splatting
+                std::unique_lock bufferLock(buffer.mutex);
+                std::swap(buffer.records, buffer.flushing);
+            }
+
+            splatRecords(buffer.flushing);
+        }
+
+        size_t count = buffer.flushing.size();
+        buffer.flushing.clear();
+
+        if ((m_samplesSoFar += count) > m_nextCheck) {
+            checkSchedule();
+        }
+    }
+
+    /**
+     * Splats all samples that are waiting in thread-local buffers.
+     * Requires m_mutex to be held exclusively.
+     */
+    void drainBuffers() {
+        std::unique_lock buffersLock(m_buffersMutex);
+        for (auto &buffer : m_buffers) {
+            std::unique_lock bufferLock(buffer->mutex);
+            m_samplesSoFar += buffer->records.size();
+            splatRecords(buffer->records);
+            buffer->records.clear();
+        }
+    }
+
+    void splatRecords(const std::vector<SplatRecord> &records) {
+        for (auto &record : records) {
+            SeededRandom random(record.seed);
+            std::apply([&](auto &... coordinates) {
+                m_training->splat(
+                    settings.child, random,
+                    record.density, record.aux, record.weight,
+                    coordinates...
+                );
+            }, record.coordinates);
+        }
+    }
+
+    typedef std::vector<std::vector<SplatRecord>> DeferredRecords;
+
+    /**
+     * Takes the samples out of all buffers, so that render threads can continue to fill them
+     * (see Settings::deferredSplatting).
+     * Requires m_mutex to be held exclusively.
+     */
+    DeferredRecords takeDeferred() {
+        std::unique_lock buffersLock(m_buffersMutex);
+        DeferredRecords pending;
+        for (auto &buffer : m_buffers) {
+            std::unique_lock bufferLock(buffer->mutex);
+            pending.push_back(std::move(buffer->records));
+            buffer->records = {};
+        }
+        return pending;
+    }
+
+    /**
+     * Splats samples that have been taken out by takeDeferred in Morton order.
+     * Requires exclusive access to training, but not m_mutex.
+     */
+    void splatDeferred(Distribution &training, const DeferredRecords &pending) const {
+        std::vector<std::pair<uint64_t, const SplatRecord *>> order;
+        for (auto &records : pending)
+            for (auto &record : records)
+                order.emplace_back(mortonCode(record.coordinates), &record);
+        if (order.empty())
             return;
+
+        std::sort(order.begin(), order.end(), [](const auto &a, const auto &b) {
+            return a.first < b.first;
+        });
+
+        int threads = settings.deferredThreads;
+        if (threads <= 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        
+        // every thread receives one contiguous range of the curve
+        parallelFor(size_t(threads), threads, [&](size_t range) {
+            size_t begin = order.size() * range / threads;
+            size_t end = order.size() * (range + 1) / threads;
+            for (size_t i = begin; i < end; ++i) {
+                auto &record = *order[i].second;
+                SeededRandom random(record.seed);
+                std::apply([&](auto &... coordinates) {
+                    training.splat(
+                        settings.child, random,
+                        record.density, record.aux, record.weight,
+                        coordinates...
+                    );
+                }, record.coordinates);
+            }
+        });
+    }
+
+    /**
+     * The total number of coordinates of the given level and all levels nested in it,
+     * where I is the index of the level's vector in Coordinates.
+     */
+    template<typename Level, size_t I = 0>
+    static constexpr int coordinateCount() {
+        if constexpr (I < std::tuple_size<Coordinates>::value)
+            return int(Level::Dimension) + coordinateCount<typename Level::Child, I + 1>();
+        else
+            return 0;
+    }
+
+    template<typename Level, size_t I = 0, int Bits, size_t N>
+    static void quantize(const Coordinates &coordinates, std::array<uint32_t, N> &quantized, size_t index = 0) {
+        if constexpr (I < std::tuple_size<Coordinates>::value) {
+            auto &vector = std::get<I>(coordinates);
+            for (int dim = 0; dim < Level::Dimension; ++dim) {
+                Float clamped = std::min(std::max(Float(vector[dim]), Float(0)), Float(1));
+                quantized[index++] = std::min(uint32_t(clamped * (1u << Bits)), (1u << Bits) - 1);
+            }
+            quantize<typename Level::Child, I + 1, Bits>(coordinates, quantized, index);
+        }
+    }
+
+    /**
+     * Interleaves the bits of all coordinates of a sample (e.g., position and direction)
+     * into a key for sorting along a Morton curve.
+     */
+    static uint64_t mortonCode(const Coordinates &coordinates) {
+        constexpr int Dimensions = coordinateCount<Distribution>();
+        constexpr int Bits = std::max(1, std::min(21, 64 / std::max(1, Dimensions)));
+
+        std::array<uint32_t, Dimensions> quantized;
+        quantize<Distribution, 0, Bits>(coordinates, quantized);
+
+        uint64_t code = 0;
+        for (int bit = Bits - 1; bit >= 0; --bit)
+            for (int dim = 0; dim < Dimensions; ++dim)
+                code = (code << 1) | ((quantized[dim] >> bit) & 1);
+        return code;
+    }
+
+    void discardBuffers() {
+        std::unique_lock lock(m_buffersMutex);
+        for (auto &buffer : m_buffers) {
+            std::unique_lock bufferLock(buffer->mutex);
+            buffer->records.clear();
+        }
+    }
+
+    /**
+     * Restarts the schedule as if the given number of samples had been received.
+     * Requires m_mutex to be held exclusively.
+     */
+    void resetSchedule(size_t samples) {
+        m_samplesSoFar  = samples;
+        m_nextMilestone = std::max(settings.scheduleSamples, size_t(settings.scheduleGrowth * samples));
+        m_samplesAtRebuild = samples;
+        m_lastRebuild = std::chrono::steady_clock::now();
+        m_estimatesAtRebuild = estimates();
+        m_nextCheck = nextCheck();
+    }
+
+    template<typename D>
+    static void overrideResetFactor(typename D::Settings &settings, Float resetFactor) {
+        if constexpr (has_child_settings<typename D::Settings>::value)
+            overrideResetFactor<typename D::Child>(settings.child, resetFactor);
+        else
+            settings.resetFactor = resetFactor;
+    }
+
+    /**
+     * Requires m_mutex to be held.
+     */
+    bool isDue() const {
+        size_t samples = m_samplesSoFar;
+        if (settings.schedule == RebuildSchedule::ESamples)
+            return samples >= m_nextMilestone;
+        
+        if (samples < m_samplesAtRebuild + settings.scheduleSamples)
+            return false;
+        
+        if (settings.schedule == RebuildSchedule::ETime) {
+            auto elapsed = std::chrono::steady_clock::now() - m_lastRebuild;
+            return std::chrono::duration<double>(elapsed).count() >= settings.scheduleInterval;
+        }
+
+        if (samples >= m_nextMilestone)
+            return true;
         
-        m_training.build(settings.child);
-        m_sampling = m_training;
-        m_training.refine(settings.child);
+        Moments moments = estimates();
+        double count = double(moments.count - m_estimatesAtRebuild.count);
+        double mean  = (moments.sum - m_estimatesAtRebuild.sum) / count;
+        double variance = (moments.sumSquares - m_estimatesAtRebuild.sumSquares) / count - mean * mean;
+        return mean > 0 && std::sqrt(std::max(variance, 0.0) / count) <= settings.scheduleError * mean;
+    }
+
+    /**
+     * The sample count at which the schedule needs to be consulted next.
+     * Requires m_mutex to be held exclusively.
+     */
+    size_t nextCheck() const {
+        if (settings.schedule == RebuildSchedule::ESamples)
+            return m_nextMilestone;
+        return m_samplesAtRebuild + settings.scheduleSamples;
+    }
+
+    /**
+     * Called once the sample count has passed m_nextCheck.
+     */
+    void checkSchedule() {
+        if (settings.trigger == RebuildTrigger::EManual) {
+            // step() will be called by the host
+            m_nextCheck = std::numeric_limits<size_t>::max();
+            return;
+        }
+
+        if (settings.trigger == RebuildTrigger::EThread) {
+            // the dedicated thread takes a moment to respond, remind it later if it has not done so by then
+            m_nextCheck = m_samplesSoFar + ScheduleCheckInterval;
+            if (rebuildDue())
+                signalScheduler();
+            return;
+        }
+
+        if (settings.schedule != RebuildSchedule::ESamples) {
+            // the schedule might not be met yet, look again later
+            m_nextCheck = m_samplesSoFar + ScheduleCheckInterval;
+            if (!rebuildDue())
+                return;
+        }
+
+        step();
+    }
+
+    void signalScheduler() {
+        {
+            std::unique_lock lock(m_schedulerMutex);
+            if (!m_schedulerThread.joinable())
+                m_schedulerThread = std::thread([this]() { runScheduler(); });
+            m_stepRequested = true;
+        }
+        m_schedulerCondition.notify_one();
+    }
+
+    void runScheduler() {
+        std::unique_lock lock(m_schedulerMutex);
+        while (true) {
+            m_schedulerCondition.wait(lock, [&]() { return m_stepRequested || m_stopScheduler; });
+            if (m_stopScheduler)
+                return;
+            
+            m_stepRequested = false;
+            lock.unlock();
+            step();
+            lock.lock();
+        }
+    }
+
+    void stopScheduler() {
+        {
+            std::unique_lock lock(m_schedulerMutex);
+            m_stopScheduler = true;
+        }
+        m_schedulerCondition.notify_one();
+
+        if (m_schedulerThread.joinable())
+            m_schedulerThread.join();
+    }
+
+    Moments estimates() const {
+        Moments moments;
+        std::unique_lock lock(m_buffersMutex);
+        for (auto &buffer : m_buffers) {
+            moments.count      += buffer->estimates.count.load(std::memory_order_relaxed);
+            moments.sum        += buffer->estimates.sum.load(std::memory_order_relaxed);
+            moments.sumSquares += buffer->estimates.sumSquares.load(std::memory_order_relaxed);
+        }
+        return moments;
+    }
+
+    /**
+     * Builds the training distribution, and returns a copy of it that can be used for sampling.
+     * The training distribution is then refined to receive the samples of the next iteration.
+     */
+    std::shared_ptr<const Distribution> rebuild(
+        Distribution &training, Statistics &stats,
+        std::shared_ptr<const CompactDistribution> &compact
+    ) {
+        typedef std::chrono::steady_clock Clock;
+        auto seconds = [](Clock::time_point a, Clock::time_point b) {
+            return std::chrono::duration<double>(b - a).count();
+        };
+
+        size_t leavesBefore = 0;
+        if (onRebuildStatistics) {
+            TreeStatistics before;
+            training.collectStatistics(before);
+            leavesBefore = before.leafCount;
+        }
+
+        auto start = Clock::now();
+        training.build(settings.child);
+        auto built = Clock::now();
+        auto sampling = std::make_shared<const Distribution>(training);
+        auto copied = Clock::now();
+        compact.reset();
+        if (settings.compactSampling)
+            compact = std::make_shared<const CompactDistribution>(*sampling);
+        training.refine(settings.child);
+        auto refined = Clock::now();
+
+        if (onRebuildStatistics) {
+            stats.buildTime  = seconds(start, built);
+            stats.copyTime   = seconds(built, copied);
+            stats.refineTime = seconds(copied, refined);
+
+            sampling->collectStatistics(stats.sampling);
+            training.collectStatistics(stats.training);
+            stats.prunedLeaves = leavesBefore - std::min(leavesBefore, stats.sampling.leafCount);
+            stats.compactByteSize = compact ? compact->byteSize() : 0;
+
+            onRebuildStatistics(stats);
+        }
 
         if (onRebuild)
             onRebuild();
 
-        //m_sampling.dump("");
+        //sampling->dump("");
 
-        m_nextMilestone *= 2;
+        return sampling;
     }
 
-    Distribution m_sampling, m_training;
+    /**
+     * Fills in the parts of the statistics that concern the iteration that has just ended.
+     * Requires m_mutex to be held exclusively.
+     */
+    Statistics beginStatistics() {
+        Statistics stats;
+        stats.generation   = m_generation + 1;
+        stats.samplesSoFar = m_samplesSoFar;
+        stats.samples      = stats.samplesSoFar - m_samplesAtRebuild;
+
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - m_lastRebuild).count();
+        stats.splatRate = elapsed > 0 ? stats.samples / elapsed : 0;
+
+        stats.sharedLockWaits    = m_sharedLockWaits.exchange(0);
+        stats.exclusiveLockWaits = m_exclusiveLockWaits.exchange(0);
+
+        m_samplesAtRebuild = stats.samplesSoFar;
+        m_lastRebuild = now;
+        return stats;
+    }
+
+    std::shared_lock<std::shared_mutex> sharedLock() const {
+        if (!settings.countContention)
+            return std::shared_lock(m_mutex);
+        
+        std::shared_lock lock(m_mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            ++m_sharedLockWaits;
+            lock.lock();
+        }
+        return lock;
+    }
+
+    std::unique_lock<std::shared_mutex> exclusiveLock() {
+        if (!settings.countContention)
+            return std::unique_lock(m_mutex);
+        
+        std::unique_lock lock(m_mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            ++m_exclusiveLockWaits;
+            lock.lock();
+        }
+        return lock;
+    }
+
+    std::shared_ptr<const Distribution> m_sampling;
+    std::shared_ptr<const CompactDistribution> m_compact; // only with Settings::compactSampling
+
+    // see Settings::replicateSampling, indexed by NUMA node, only cleared while m_mutex is held exclusively
+    typedef std::array<std::unique_ptr<const Distribution>, 16> Replicas;
+    mutable Replicas m_replicas;
+    mutable std::mutex m_replicasMutex;
+    std::unique_ptr<Distribution> m_training;
 
     std::atomic<size_t> m_samplesSoFar;
-    size_t m_nextMilestone;
+    size_t m_nextMilestone; // guarded by m_mutex
+    std::atomic<size_t> m_nextCheck; // sample count after which the schedule is consulted, see checkSchedule
 
     mutable std::shared_mutex m_mutex;
+
+    uint64_t m_generation = 0; // guarded by m_mutex
+
+    // guarded by m_mutex
+    size_t m_samplesAtRebuild = 0;
+    std::chrono::steady_clock::time_point m_lastRebuild;
+    Moments m_estimatesAtRebuild;
+
+    mutable std::atomic<uint64_t> m_sharedLockWaits = 0;
+    mutable std::atomic<uint64_t> m_exclusiveLockWaits = 0;
+
+    const uint64_t m_id = uniqueInstanceId();
+    mutable std::mutex m_buffersMutex;
+    std::vector<std::unique_ptr<SplatBuffer>> m_buffers;
+
+    std::atomic<bool> m_rebuilding = false;
+    mutable std::thread m_rebuildThread;
+    mutable std::mutex m_rebuildThreadMutex;
+
+    // see RebuildTrigger::EThread
+    std::thread m_schedulerThread;
+    std::mutex m_schedulerMutex;
+    std::condition_variable m_schedulerCondition;
+    bool m_stepRequested = false; // guarded by m_schedulerMutex
+    bool m_stopScheduler = false; // guarded by m_schedulerMutex
 };
 
 }
@@ -0,0 +1,380 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace guiding {
+
+using Float = float;
+template<int D>
+using VectorXf = std::array<Float, D>;
+
+}
+
+#include <guiding/wrapper.h>
+#include <guiding/structures/btree.h>
+#include <guiding/structures/kdtree.h>
+#include <guiding/structures/vmf.h>
+
+using namespace guiding;
+
+//
+// headless benchmark that reports throughput as one JSON object per line
+//
+
+struct Options {
+    size_t trainingSamples = 1 << 20;
+    size_t queries = 1 << 20;
+    int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+};
+
+/**
+ * The same setup as demo-2d.
+ */
+struct Scenario2D {
+    static constexpr const char *Name = "btree2";
+
+    typedef BTree<2, Leaf<Empty>, Float> Distribution;
+    typedef Distribution::Settings Settings;
+
+    struct Point {
+        VectorXf<2> x;
+    };
+
+    static Point draw(SeededRandom &rnd) {
+        return { { rnd(), rnd() } };
+    }
+
+    static Float integrand(const Point &p) {
+        Float v = 1;
+        v *= std::exp(-std::pow(10 * p.x[1] + p.x[0] - 5, 2.f));
+        v *=
+            0.8f * std::exp(-std::pow(10 * p.x[0] - 5, 2.f)) +
+            0.2f * std::exp(-std::pow( 2 * p.x[0] + p.x[1] - 1, 2.f))
+        ;
+        return v;
+    }
+
+    static void configure(Settings &settings, TreeFilter::Enum filtering, TreeSplitting::Enum splitting) {
+        settings.splitThreshold = splitting == TreeSplitting::EWeight ? 100.f : 0.0015f;
+        settings.splitting = splitting;
+        settings.filtering = filtering;
+    }
+
+    template<typename W>
+    static Float sample(W &w, Point &p) { return w.sample(p.x); }
+
+    template<typename W>
+    static void splat(W &w, const Point &p, Float f, Float weight) { w.splat(f, { f, {} }, weight, p.x); }
+
+    static Float sample(const Distribution &d, const Settings &s, Point &p) {
+        Float pdf;
+        d.sample(s, pdf, p.x);
+        return pdf;
+    }
+
+    static Float pdf(const Distribution &d, const Settings &s, const Point &p) { return d.pdf(s, p.x); }
+
+    template<typename View>
+    static Float sample(const View &v, const Settings &s, Point &p) {
+        Float pdf;
+        v.sample(s, 0, pdf, p.x);
+        return pdf;
+    }
+
+    template<typename View>
+    static Float pdf(const View &v, const Settings &s, const Point &p) { return v.pdf(s, 0, p.x); }
+
+    static void splat(Distribution &d, const Settings &s, const Point &p, Float f, Float weight) {
+        d.splat(s, f, { f, {} }, weight, p.x);
+    }
+};
+
+/**
+ * The same setup as demo-5d.
+ */
+struct Scenario5D {
+    static constexpr const char *Name = "kdtree3-btree2";
+
+    typedef KDTree<3, BTree<2, Leaf<Empty>>> Distribution;
+    typedef Distribution::Settings Settings;
+
+    struct Point {
+        VectorXf<3> x;
+        VectorXf<2> d;
+    };
+
+    static Point draw(SeededRandom &rnd) {
+        return { { rnd(), rnd(), rnd() }, { rnd(), rnd() } };
+    }
+
+    static Float integrand(const Point &p) {
+        Float v = 1;
+        v *= std::exp(-20 * std::pow(p.x[0] - p.d[0], 2.f));
+        v *= std::exp(-20 * std::pow(p.x[1] - p.d[1], 2.f));
+        return v;
+    }
+
+    static void configure(Settings &settings, TreeFilter::Enum filtering, TreeSplitting::Enum splitting) {
+        settings.splitThreshold = splitting == TreeSplitting::EWeight ? 1000.f : 0.01f;
+        settings.splitting = splitting;
+        settings.filtering = filtering;
+        settings.child.splitThreshold = 0.01f;
+        settings.child.filtering = filtering;
+    }
+
+    template<typename W>
+    static Float sample(W &w, Point &p) { return w.sample(p.x, p.d); }
+
+    template<typename W>
+    static void splat(W &w, const Point &p, Float f, Float weight) { w.splat(f, {}, weight, p.x, p.d); }
+
+    static Float sample(const Distribution &d, const Settings &s, Point &p) {
+        Float pdf;
+        d.sample(s, pdf, p.x, p.d);
+        return pdf;
+    }
+
+    static Float pdf(const Distribution &d, const Settings &s, const Point &p) { return d.pdf(s, p.x, p.d); }
+
+    template<typename View>
+    static Float sample(const View &v, const Settings &s, Point &p) {
+        Float pdf;
+        v.sample(s, 0, pdf, p.x, p.d);
+        return pdf;
+    }
+
+    template<typename View>
+    static Float pdf(const View &v, const Settings &s, const Point &p) { return v.pdf(s, 0, p.x, p.d); }
+
+    static void splat(Distribution &d, const Settings &s, const Point &p, Float f, Float weight) {
+        d.splat(s, f, {}, weight, p.x, p.d);
+    }
+};
+
+/**
+ * The setup of demo-5d, with a mixture of von Mises-Fisher lobes as directional distribution.
+ */
+struct ScenarioVMF : Scenario5D {
+    static constexpr const char *Name = "kdtree3-vmf4";
+
+    typedef KDTree<3, VMFMixture<4>> Distribution;
+    typedef Distribution::Settings Settings;
+
+    static void configure(Settings &settings, TreeFilter::Enum filtering, TreeSplitting::Enum splitting) {
+        settings.splitThreshold = splitting == TreeSplitting::EWeight ? 1000.f : 0.01f;
+        settings.splitting = splitting;
+        settings.filtering = filtering;
+    }
+
+    using Scenario5D::sample;
+    using Scenario5D::pdf;
+    using Scenario5D::splat;
+
+    static Float sample(const Distribution &d, const Settings &s, Point &p) {
+        Float pdf;
+        d.sample(s, pdf, p.x, p.d);
+        return pdf;
+    }
+
+    static Float pdf(const Distribution &d, const Settings &s, const Point &p) { return d.pdf(s, p.x, p.d); }
+
+    template<typename View>
+    static Float sample(const View &v, const Settings &s, Point &p) {
+        Float pdf;
+        v.sample(s, 0, pdf, p.x, p.d);
+        return pdf;
+    }
+
+    template<typename View>
+    static Float pdf(const View &v, const Settings &s, const Point &p) { return v.pdf(s, 0, p.x, p.d); }
+
+    static void splat(Distribution &d, const Settings &s, const Point &p, Float f, Float weight) {
+        d.splat(s, f, {}, weight, p.x, p.d);
+    }
+};
+
+template<typename F>
+double measure(F &&f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Runs f(begin, end) for a range of indices that is split evenly among the given number of threads.
+ */
+template<typename F>
+double measureParallel(size_t count, int threads, F &&f) {
+    return measure([&]() {
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; ++t)
+            pool.emplace_back([&, t]() {
+                f(count * t / threads, count * (t + 1) / threads);
+            });
+        for (auto &thread : pool)
+            thread.join();
+    });
+}
+
+struct Result {
+    const char *benchmark;
+    const char *config;
+    TreeFilter::Enum filtering;
+    TreeSplitting::Enum splitting;
+    int threads;
+    size_t operations;
+    double seconds;
+};
+
+void report(const Result &result) {
+    printf(
+        "{\"benchmark\": \"%s\", \"config\": \"%s\", \"filter\": \"%s\", \"splitting\": \"%s\", "
+        "\"threads\": %d, \"operations\": %zu, \"seconds\": %.6f, \"rate\": %.1f}\n",
+        result.benchmark, result.config,
+        TreeFilter::to_string(result.filtering),
+        result.splitting == TreeSplitting::EWeight ? "weight" : "density",
+        result.threads, result.operations, result.seconds,
+        result.operations / std::max(result.seconds, 1e-9)
+    );
+    fflush(stdout);
+}
+
+template<typename Scenario>
+void run(const Options &options, TreeFilter::Enum filtering, TreeSplitting::Enum splitting) {
+    typedef typename Scenario::Distribution Distribution;
+    typedef typename Scenario::Point Point;
+
+    // train a distribution so that we benchmark realistic tree shapes
+    Wrapper<Distribution> wrapper;
+    wrapper.settings.uniformProb = 0.1f;
+    Scenario::configure(wrapper.settings.child, filtering, splitting);
+
+    auto &settings = wrapper.settings.child;
+    for (size_t i = 0; i < options.trainingSamples; ++i) {
+        SeededRandom rnd { uint32_t(i) };
+        Point p = Scenario::draw(rnd);
+        Float pdf = Scenario::sample(wrapper, p);
+        Scenario::splat(wrapper, p, Scenario::integrand(p), 1 / pdf);
+    }
+
+    const Distribution &sampling = wrapper.sampling();
+    Compact<Distribution> compact(sampling);
+    auto compactView = compact.view();
+
+    TreeStatistics statistics;
+    sampling.collectStatistics(statistics);
+
+    std::vector<Point> points(options.queries);
+    std::vector<Float> values(options.queries);
+    for (size_t i = 0; i < options.queries; ++i) {
+        SeededRandom rnd { uint32_t(i) ^ 0x9e3779b9u };
+        points[i] = Scenario::draw(rnd);
+        values[i] = Scenario::integrand(points[i]);
+    }
+
+    Result result = { "", Scenario::Name, filtering, splitting, 1, 0, 0 };
+
+    printf(
+        "{\"benchmark\": \"tree\", \"config\": \"%s\", \"filter\": \"%s\", \"splitting\": \"%s\", "
+        "\"nodes\": %zu, \"totalNodes\": %zu, \"depth\": %d, \"bytes\": %zu, \"compactBytes\": %zu}\n",
+        Scenario::Name, TreeFilter::to_string(filtering),
+        splitting == TreeSplitting::EWeight ? "weight" : "density",
+        sampling.nodeCount(), sampling.totalNodeCount(), sampling.depth(),
+        statistics.byteSize, compact.byteSize()
+    );
+
+    for (int threads = 1; threads <= options.maxThreads; threads *= 2) {
+        result.threads = threads;
+        result.operations = options.queries;
+
+        std::vector<Float> pdfs(options.queries);
+        result.benchmark = "sample";
+        result.seconds = measureParallel(options.queries, threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                Point p = points[i];
+                pdfs[i] = Scenario::sample(sampling, settings, p);
+            }
+        });
+        report(result);
+
+        result.benchmark = "pdf";
+        result.seconds = measureParallel(options.queries, threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                pdfs[i] = Scenario::pdf(sampling, settings, points[i]);
+        });
+        report(result);
+
+        result.benchmark = "compact-sample";
+        result.seconds = measureParallel(options.queries, threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                Point p = points[i];
+                pdfs[i] = Scenario::sample(compactView, settings, p);
+            }
+        });
+        report(result);
+
+        result.benchmark = "compact-pdf";
+        result.seconds = measureParallel(options.queries, threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                pdfs[i] = Scenario::pdf(compactView, settings, points[i]);
+        });
+        report(result);
+
+        Distribution training = wrapper.training();
+        result.benchmark = "splat";
+        result.seconds = measureParallel(options.queries, threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                Scenario::splat(training, settings, points[i], values[i], 1);
+        });
+        report(result);
+
+        auto buildSettings = settings;
+        buildSettings.threads = threads;
+
+        result.benchmark = "build";
+        result.operations = training.totalNodeCount();
+        result.seconds = measure([&]() { training.build(buildSettings); });
+        report(result);
+
+        result.benchmark = "refine";
+        result.operations = training.totalNodeCount();
+        result.seconds = measure([&]() { training.refine(buildSettings); });
+        report(result);
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--quick")) {
+            options.trainingSamples = 1 << 17;
+            options.queries = 1 << 17;
+        } else if (!strcmp(argv[i], "--samples") && i + 1 < argc) {
+            options.trainingSamples = strtoull(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--queries") && i + 1 < argc) {
+            options.queries = strtoull(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            options.maxThreads = std::max(1, atoi(argv[++i]));
+        } else {
+            fprintf(stderr, "usage: %s [--quick] [--samples N] [--queries N] [--threads N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (auto splitting : { TreeSplitting::EDensity, TreeSplitting::EWeight }) {
+        for (int filtering = 0; filtering < TreeFilter::Max; ++filtering) {
+            run<Scenario2D>(options, TreeFilter::Enum(filtering), splitting);
+            run<Scenario5D>(options, TreeFilter::Enum(filtering), splitting);
+            run<ScenarioVMF>(options, TreeFilter::Enum(filtering), splitting);
+        }
+    }
+
+    return 0;
+}